@@ -15,12 +15,30 @@
  */
 
 #include <stdint.h>
+#include <string.h>
 #include "Bus.h"
 #include "Crc.h"
 #include "BaseProtocol.h"
+#include "BootProfile.h"
+#include "CommandStats.h"
+#include "bootloader.h"
+#include "Buffers.h"
 
 static int configuredAddress = 0;
 
+#if defined(HAVE_BUS_STATS)
+BusStats busStats;
+#endif // defined(HAVE_BUS_STATS)
+
+uint8_t getConfiguredAddress() {
+	return configuredAddress;
+}
+
+void setConfiguredAddress(uint8_t address) {
+	BusSetDeviceAddress(address);
+	configuredAddress = address;
+}
+
 static int handleGeneralCall(uint8_t *data, uint8_t len, uint8_t /* maxLen */) {
 	if (len == 1 && data[0] == GeneralCallCommands::RESET) {
 		resetSystem();
@@ -31,7 +49,7 @@ static int handleGeneralCall(uint8_t *data, uint8_t len, uint8_t /* maxLen */) {
 	return 0;
 }
 
-cmd_result handleCommand(uint8_t cmd, uint8_t *datain, uint8_t len, uint8_t *dataout, uint8_t maxLen) {
+static cmd_result dispatchCommand(uint8_t cmd, uint8_t *datain, uint8_t len, uint8_t *dataout, uint8_t maxLen) {
 	if (maxLen < 5)
 		return cmd_result(Status::NO_REPLY);
 
@@ -50,8 +68,7 @@ cmd_result handleCommand(uint8_t cmd, uint8_t *datain, uint8_t len, uint8_t *dat
 			if (datain[1] != 0 && datain[1] != INFO_HW_TYPE)
 				return cmd_result(Status::NO_REPLY);
 
-			BusSetDeviceAddress(datain[0]);
-			configuredAddress = datain[0];
+			setConfiguredAddress(datain[0]);
 			return cmd_ok();
 		case ProtocolCommands::GET_MAX_PACKET_LENGTH:
 			dataout[0] = MAX_PACKET_LENGTH >> 8;
@@ -62,6 +79,77 @@ cmd_result handleCommand(uint8_t cmd, uint8_t *datain, uint8_t len, uint8_t *dat
 	}
 }
 
+static cmd_result runCommand(uint8_t cmd, uint8_t *datain, uint8_t len, uint8_t *dataout, uint8_t maxLen) {
+	#if defined(HAVE_COMMAND_STATS)
+	uint32_t start = TimerMicros();
+	cmd_result res = dispatchCommand(cmd, datain, len, dataout, maxLen);
+	CommandStats::record(cmd, TimerMicros() - start);
+	return res;
+	#else
+	return dispatchCommand(cmd, datain, len, dataout, maxLen);
+	#endif // defined(HAVE_COMMAND_STATS)
+}
+
+#if defined(HAVE_BATCH)
+static cmd_result handleBatch(uint8_t *datain, uint8_t len, uint8_t *dataout, uint8_t maxLen) {
+	// Check that all sub-commands are complete before running any
+	uint8_t pos = 0;
+	while (pos < len) {
+		if (len - pos < 2 || datain[pos + 1] > len - pos - 2)
+			return cmd_result(Status::INVALID_ARGUMENTS);
+		pos += 2 + datain[pos + 1];
+	}
+
+	// Sub-commands get the same maxLen as normal commands (so the
+	// optimizer can still resolve compiletime checks), which is
+	// always less than the buffer size.
+	uint8_t subMaxLen = maxLen;
+	if (subMaxLen > sizeof(buffers.batch) - 2)
+		subMaxLen = sizeof(buffers.batch) - 2;
+
+	// Replies can be longer than their sub-commands, so move the
+	// sub-commands to the end of the buffer, to prevent overwriting
+	// them before they are run.
+	uint8_t *end = dataout + maxLen;
+	uint8_t *in = end - len;
+	memmove(in, datain, len);
+
+	uint8_t *out = dataout;
+	while (in < end) {
+		uint8_t cmd = in[0];
+		uint8_t subLen = in[1];
+		memcpy(buffers.batch, in + 2, subLen);
+		in += 2 + subLen;
+
+		cmd_result res = runCommand(cmd, buffers.batch, subLen, buffers.batch + 2, subMaxLen);
+		if (res.status == Status::NO_REPLY)
+			return res;
+
+		// Stop when the reply does not fit (the master can
+		// tell from the number of sub-replies)
+		if (2 + res.len > in - out)
+			break;
+
+		out[0] = res.status;
+		out[1] = res.len;
+		memcpy(out + 2, buffers.batch + 2, res.len);
+		out += 2 + res.len;
+
+		if (res.status != Status::COMMAND_OK)
+			break;
+	}
+	return cmd_ok(out - dataout);
+}
+#endif // defined(HAVE_BATCH)
+
+cmd_result handleCommand(uint8_t cmd, uint8_t *datain, uint8_t len, uint8_t *dataout, uint8_t maxLen) {
+	#if defined(HAVE_BATCH)
+	if (cmd == ProtocolCommands::BATCH)
+		return handleBatch(datain, len, dataout, maxLen);
+	#endif // defined(HAVE_BATCH)
+	return runCommand(cmd, datain, len, dataout, maxLen);
+}
+
 // The bus implementation will already have checked whether the request
 // is addressed to us, this just checks whether child select maybe
 // prevents a response.
@@ -69,7 +157,9 @@ bool shouldRespondToAddress(uint8_t address) {
 	#if defined(USE_CHILD_SELECT)
 	// Child select does not apply to general call or the configured
 	// address, and the pin is active low.
-	return address == 0 || address == configuredAddress || !CHILD_SELECT_PIN.read();
+	// The pin is set up by runBootloader(), so this is just a
+	// register read.
+	return address == 0 || address == configuredAddress || !CHILD_SELECT_PIN.readInput();
 	#else
 	(void)address; // unused
 	return true;
@@ -77,9 +167,22 @@ bool shouldRespondToAddress(uint8_t address) {
 }
 
 #if defined(USE_I2C)
+	uint8_t finishReply(uint8_t *data, cmd_result res) {
+		data[0] = res.status;
+		data[1] = res.len;
+		uint8_t len = res.len + 2;
+
+		uint8_t crc = Crc8Ccitt().update(data, len).get();
+		data[len++] = crc;
+		return len;
+	}
+
 	int BusCallback(uint8_t address, uint8_t *data, uint8_t len, uint8_t maxLen) {
-		if (!shouldRespondToAddress(address))
+		BOOT_PROFILE(FIRST_FRAME);
+		if (!shouldRespondToAddress(address)) {
+			BUS_STATS_INC(repliesSuppressed);
 			return 0;
+		}
 
 		if (address == 0)
 			return handleGeneralCall(data, len, maxLen);
@@ -95,6 +198,7 @@ bool shouldRespondToAddress(uint8_t address) {
 		} else {
 			uint8_t crc = Crc8Ccitt().update(data, len).get();
 			if (crc != 0) {
+				BUS_STATS_INC(crcErrors);
 				res = cmd_result(Status::INVALID_CRC);
 			} else {
 				// CRC checks out, process a command
@@ -104,19 +208,116 @@ bool shouldRespondToAddress(uint8_t address) {
 			}
 		}
 
-		data[0] = res.status;
-		data[1] = res.len;
-		len = res.len + 2;
-
-		uint8_t crc = Crc8Ccitt().update(data, len).get();
-		data[len++] = crc;
+		len = finishReply(data, res);
 
+		BOOT_PROFILE(FIRST_REPLY);
 		return len;
 	}
 #elif defined(USE_RS485)
+	#if defined(HAVE_SLOTTED_QUERY)
+	// Runs the command from a SLOTTED_QUERY general call, and
+	// arranges for the reply to be sent in the time slot for our
+	// address.
+	static cmd_result handleSlottedQuery(uint8_t *data, uint8_t len, uint8_t maxLen) {
+		// Only children with an address have a slot
+		if (len < 5 || configuredAddress == 0)
+			return cmd_result(Status::NO_REPLY);
+
+		uint8_t first = data[1];
+		uint8_t count = data[2];
+		uint8_t slotLength = data[3];
+		uint8_t cmd = data[4];
+		uint8_t slot = configuredAddress - first;
+		if (configuredAddress < first || slot >= count)
+			return cmd_result(Status::NO_REPLY);
+
+		// This would give all children the same address
+		if (cmd == ProtocolCommands::SET_ADDRESS)
+			return cmd_result(Status::NO_REPLY);
+
+		// Move the arguments to where they are for normal
+		// commands, so the command handlers see the same
+		// buffer layout.
+		len -= 5;
+		memmove(data + 1, data + 5, len);
+		cmd_result res = handleCommand(cmd, data + 1, len, data + 3, maxLen - 5);
+
+		// Replies that do not fit the slot would collide with
+		// the next one
+		if (res.status == Status::NO_REPLY || res.len + 5 > slotLength)
+			return cmd_result(Status::NO_REPLY);
+
+		BusDelayReply(slot, slotLength);
+		return res;
+	}
+	#endif // defined(HAVE_SLOTTED_QUERY)
+
+	#if defined(HAVE_SERIAL_SEARCH)
+	#if !defined(HAVE_SERIAL_NUMBER)
+	#error "HAVE_SERIAL_SEARCH needs a serial number"
+	#endif
+
+	// Returns whether the first bits of our serial number match
+	// prefix (most significant bit first)
+	static bool serialMatches(const uint8_t *prefix, uint8_t bits) {
+		uint8_t serial[SERIAL_NUMBER_SIZE];
+		readSerialNumber(serial);
+		for (uint8_t i = 0; bits; ++i) {
+			uint8_t n = bits < 8 ? bits : 8;
+			uint8_t mask = 0xff00 >> n;
+			if ((serial[i] ^ prefix[i]) & mask)
+				return false;
+			bits -= n;
+		}
+		return true;
+	}
+
+	// Lets a child without an address reply with its serial number
+	// when it starts with the given prefix, to allow the master to
+	// find all serial numbers using a binary search.
+	static cmd_result handleSearchSerial(uint8_t *data, uint8_t len, uint8_t maxLen) {
+		if (len < 2 || configuredAddress != 0)
+			return cmd_result(Status::NO_REPLY);
+
+		uint8_t bits = data[1];
+		if (bits > SERIAL_NUMBER_SIZE * 8 || len != 2 + (bits + 7) / 8)
+			return cmd_result(Status::NO_REPLY);
+
+		if (!serialMatches(data + 2, bits))
+			return cmd_result(Status::NO_REPLY);
+
+		if (maxLen < 5 + SERIAL_NUMBER_SIZE)
+			return cmd_result(Status::NO_REPLY);
+
+		readSerialNumber(data + 3);
+		return cmd_ok(SERIAL_NUMBER_SIZE);
+	}
+
+	// Like SET_ADDRESS, but only for the child with the given
+	// serial number
+	static cmd_result handleSetAddressBySerial(uint8_t *data, uint8_t len) {
+		if (len != 3 + SERIAL_NUMBER_SIZE)
+			return cmd_result(Status::NO_REPLY);
+
+		uint8_t address = data[1];
+		uint8_t hwType = data[2];
+		if (hwType != 0 && hwType != INFO_HW_TYPE)
+			return cmd_result(Status::NO_REPLY);
+
+		if (!serialMatches(data + 3, SERIAL_NUMBER_SIZE * 8))
+			return cmd_result(Status::NO_REPLY);
+
+		setConfiguredAddress(address);
+		return cmd_ok();
+	}
+	#endif // defined(HAVE_SERIAL_SEARCH)
+
 	int BusCallback(uint8_t address, uint8_t *data, uint8_t len, uint8_t maxLen) {
-		if (!shouldRespondToAddress(address))
+		BOOT_PROFILE(FIRST_FRAME);
+		if (!shouldRespondToAddress(address)) {
+			BUS_STATS_INC(repliesSuppressed);
 			return 0;
+		}
 
 		// Check that there is at least room for an address, status, length and CRC
 		if (maxLen < 5)
@@ -133,9 +334,32 @@ bool shouldRespondToAddress(uint8_t address) {
 				// be sure that the message was really
 				// for us, some someone else might also
 				// reply).
+				BUS_STATS_INC(crcErrors);
 				return 0;
 			} else if (address == 0) {
-				return handleGeneralCall(data, len - 2, maxLen);
+				switch (data[0]) {
+					#if defined(HAVE_SLOTTED_QUERY)
+					case GeneralCallCommands::SLOTTED_QUERY:
+						res = handleSlottedQuery(data, len - 2, maxLen);
+						break;
+					#endif // defined(HAVE_SLOTTED_QUERY)
+					#if defined(HAVE_SERIAL_SEARCH)
+					case GeneralCallCommands::SEARCH_SERIAL:
+						res = handleSearchSerial(data, len - 2, maxLen);
+						break;
+					case GeneralCallCommands::SET_ADDRESS_BY_SERIAL:
+						res = handleSetAddressBySerial(data, len - 2);
+						break;
+					#endif // defined(HAVE_SERIAL_SEARCH)
+					default:
+						return handleGeneralCall(data, len - 2, maxLen);
+				}
+				if (res.status == Status::NO_REPLY)
+					return 0;
+				// Reply as if the command was sent to our
+				// own address (which is still 0 for
+				// SEARCH_SERIAL)
+				address = configuredAddress;
 			} else {
 				// CRC checks out, process a command
 				res = handleCommand(data[0], data + 1, len - 3, data + 3, maxLen - 5);
@@ -153,6 +377,7 @@ bool shouldRespondToAddress(uint8_t address) {
 		data[len++] = crc;
 		data[len++] = crc >> 8;
 
+		BOOT_PROFILE(FIRST_REPLY);
 		return len;
 	}
 #endif
@@ -40,6 +40,9 @@ struct GeneralCallCommands {
 		// in the 0x40-0x48 "user defined function codes" area.
 		static const uint8_t RESET = 0x46;
 		static const uint8_t RESET_ADDRESS = 0x44;
+		static const uint8_t SLOTTED_QUERY = 0x47;
+		static const uint8_t SEARCH_SERIAL = 0x48;
+		static const uint8_t SET_ADDRESS_BY_SERIAL = 0x45;
 	#endif
 };
 
@@ -48,8 +51,17 @@ struct ProtocolCommands {
 	static const uint8_t GET_PROTOCOL_VERSION  = 0x00;
 	static const uint8_t SET_ADDRESS           = 0x01;
 	static const uint8_t GET_MAX_PACKET_LENGTH = 0x0c;
+	static const uint8_t BATCH                 = 0x19;
 };
 
+#if defined(__AVR_ATtiny841__) || defined(__AVR_ATtiny441__)
+	const uint8_t SERIAL_NUMBER_SIZE = 9;
+	#define HAVE_SERIAL_NUMBER
+#elif defined(STM32)
+	const uint8_t SERIAL_NUMBER_SIZE = 12;
+	#define HAVE_SERIAL_NUMBER
+#endif
+
 struct cmd_result {
 	cmd_result(uint8_t status, uint8_t len = 0) : status(status), len(len) {}
 	uint8_t status;
@@ -62,3 +74,20 @@ inline cmd_result cmd_ok(uint8_t len = 0) {
 
 cmd_result processCommand(uint8_t cmd, uint8_t *datain, uint8_t len, uint8_t *dataout, uint8_t maxLen);
 void resetSystem();
+// Returns the address set by SET_ADDRESS, or 0 if none
+uint8_t getConfiguredAddress();
+// Sets the address like SET_ADDRESS does
+void setConfiguredAddress(uint8_t address);
+// Returns true when the last reset was not caused by software or a
+// watchdog (e.g. poweron or the reset pin)
+bool resetWasColdBoot();
+#if defined(USE_I2C)
+// Fills in the status, length and CRC around a reply whose data is
+// already at data + 2, and returns the total length to send
+uint8_t finishReply(uint8_t *data, cmd_result res);
+#endif
+#if defined(HAVE_SERIAL_NUMBER)
+// Writes SERIAL_NUMBER_SIZE bytes of serial number (as returned by
+// GET_SERIAL_NUMBER) to buf
+void readSerialNumber(uint8_t *buf);
+#endif
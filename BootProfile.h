@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2017-2025 3devo (http://www.3devo.eu)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef BOOTPROFILE_H_
+#define BOOTPROFILE_H_
+
+#include <stdint.h>
+#include "Config.h"
+#include "bootloader.h"
+
+#if defined(HAVE_BOOT_PROFILE)
+
+// Records the time at which a number of points in the startup of the
+// bootloader are reached, to see where boot time is spent. Times are
+// in microseconds since the start of main() (before that, only RAM is
+// initialized), 0 means the point was not reached (yet).
+class BootProfile {
+public:
+	// These are in the order they are normally reached, and
+	// are returned in this order by GET_BOOT_TIMESTAMPS
+	enum Point : uint8_t {
+		OSC_READY,   // External oscillator ready (if used)
+		CLOCK_READY, // ClockInit() done
+		BUS_READY,   // BusInit() done
+		BOARD_INFO,  // Board info parsed
+		FIRST_FRAME, // First frame passed up by the bus code
+		FIRST_REPLY, // First reply passed to the bus code
+		NUM_POINTS,
+	};
+
+	static uint32_t timestamps[NUM_POINTS];
+
+	// Records the current time for the given point, unless it was
+	// already reached before.
+	static void record(Point point) {
+		if (!timestamps[point])
+			timestamps[point] = TimerMicros();
+	}
+};
+
+#define BOOT_PROFILE(point) BootProfile::record(BootProfile::point)
+
+#else
+
+#define BOOT_PROFILE(point) do { } while (0)
+
+#endif // defined(HAVE_BOOT_PROFILE)
+
+#endif /* BOOTPROFILE_H_ */
@@ -1040,7 +1040,20 @@ bool write_flash(uint8_t *data, uint16_t len, uint8_t writelen, uint8_t *erase_c
     assertOk(status, "", on_failure(reason));
     offset += nextlen;
   }
-  assertTrue(run_transaction_ok(Commands::FINALIZE_FLASH, nullptr, 0, erase_count, READ_EXACTLY(1), READ_EXACTLY(1)), "", on_failure());
+  if (SUPPORTS_FINALIZE_CRC) {
+    uint8_t flags = FINALIZE_RETURN_CRC;
+    uint8_t reply[5];
+    assertTrue(run_transaction_ok(Commands::FINALIZE_FLASH, &flags, sizeof(flags), reply, READ_EXACTLY(sizeof(reply)), READ_EXACTLY(1)), "", on_failure());
+    *erase_count = reply[0];
+
+    Crc32 crc;
+    for (uint16_t i = 0; i < len; ++i)
+      crc.update(data[i]);
+    uint32_t crcin = (uint32_t)reply[1] << 24 | (uint32_t)reply[2] << 16 | (uint32_t)reply[3] << 8 | reply[4];
+    assertEqual(crcin, ~crc.get(), "", on_failure());
+  } else {
+    assertTrue(run_transaction_ok(Commands::FINALIZE_FLASH, nullptr, 0, erase_count, READ_EXACTLY(1), READ_EXACTLY(1)), "", on_failure());
+  }
   return true;
 }
 
@@ -1193,6 +1206,901 @@ test(130_invalid_writes) {
   #endif // defined(TEST_SUBJECT_ATTINY)
 }
 
+test(140_extended_addressing) {
+  if (!SUPPORTS_EXTENDED_ADDRESSING) {
+    assertTrue(check_command_not_supported(Commands::WRITE_FLASH_EXTENDED));
+    assertTrue(check_command_not_supported(Commands::READ_FLASH_EXTENDED));
+    assertTrue(check_command_not_supported(Commands::GET_FLASH_SIZE));
+    return;
+  }
+
+  uint8_t size[4];
+  assertTrue(run_transaction_ok(Commands::GET_FLASH_SIZE, nullptr, 0, size, READ_EXACTLY(sizeof(size))));
+  assertEqual((uint32_t)size[0] << 24 | (uint32_t)size[1] << 16 | (uint32_t)size[2] << 8 | size[3], (uint32_t)AVAILABLE_FLASH_SIZE);
+
+  // Read the current flash contents with both read commands
+  uint8_t data[32], extended[32];
+  uint8_t dataout[3] = {0, 0, sizeof(data)};
+  assertTrue(run_transaction_ok(Commands::READ_FLASH, dataout, sizeof(dataout), data, READ_EXACTLY(sizeof(data))));
+  uint8_t dataout_ext[5] = {0, 0, 0, 0, sizeof(extended)};
+  assertTrue(run_transaction_ok(Commands::READ_FLASH_EXTENDED, dataout_ext, sizeof(dataout_ext), extended, READ_EXACTLY(sizeof(extended))));
+  for (uint8_t i = 0; i < sizeof(data); ++i)
+    assertEqual(data[i], extended[i]);
+
+  uint8_t status, reason;
+  // Too short address
+  assertTrue(run_transaction(Commands::WRITE_FLASH_EXTENDED, dataout_ext, 3, &status));
+  assertEqual(status, Status::INVALID_ARGUMENTS);
+  assertTrue(run_transaction(Commands::READ_FLASH_EXTENDED, dataout_ext, 3, &status));
+  assertEqual(status, Status::INVALID_ARGUMENTS);
+
+  // Write the same contents back, mixing both write commands (so
+  // nothing should be erased)
+  assertTrue(write_flash_cmd(0, data, 16, &status, &reason));
+  assertOk(status);
+  uint8_t write_ext[4 + 16] = {0, 0, 0, 16};
+  memcpy(write_ext + 4, data + 16, 16);
+  assertTrue(run_transaction(Commands::WRITE_FLASH_EXTENDED, write_ext, sizeof(write_ext), &status, &reason, READ_EXACTLY(0), READ_EXACTLY(1)));
+  assertOk(status);
+  uint8_t erase_count;
+  assertTrue(run_transaction_ok(Commands::FINALIZE_FLASH, nullptr, 0, &erase_count, READ_EXACTLY(1), READ_EXACTLY(1)));
+  assertEqual(erase_count, 0);
+}
+
+test(150_finalize_flags) {
+  uint8_t status;
+  uint8_t flags = SUPPORTS_FINALIZE_CRC ? 0x80 : FINALIZE_RETURN_CRC;
+  // Unknown or unsupported flags should be refused
+  assertTrue(run_transaction(Commands::FINALIZE_FLASH, &flags, sizeof(flags), &status));
+  assertEqual(status, Status::INVALID_ARGUMENTS);
+
+  // An explicit zero flags byte is the same as no flags
+  flags = 0;
+  uint8_t erase_count;
+  assertTrue(run_transaction(Commands::FINALIZE_FLASH, &flags, sizeof(flags), &status, &erase_count, READ_EXACTLY(1), READ_EXACTLY(1)));
+  if (SUPPORTS_FINALIZE_CRC) {
+    assertOk(status);
+    assertEqual(erase_count, 0);
+  } else {
+    assertEqual(status, Status::INVALID_ARGUMENTS);
+  }
+}
+
+bool read_flash(uint16_t address, uint8_t *data, uint16_t len) {
+  uint16_t offset = 0;
+  while (offset < len) {
+    uint8_t nextlen = min(MAX_READ_DATA_LEN, len - offset);
+    uint16_t nextaddr = address + offset;
+    uint8_t readout[3] = {(uint8_t)(nextaddr >> 8), (uint8_t)nextaddr, nextlen};
+    assertTrue(run_transaction_ok(Commands::READ_FLASH, readout, sizeof(readout), data + offset, READ_EXACTLY(nextlen)), "", false);
+    offset += nextlen;
+  }
+  return true;
+}
+
+bool finalize_with_manifest(uint8_t *tag, uint32_t *crc) {
+  uint8_t dataout[1 + MANIFEST_TAG_SIZE] = {FINALIZE_STORE_MANIFEST | FINALIZE_RETURN_CRC};
+  memcpy(dataout + 1, tag, MANIFEST_TAG_SIZE);
+  uint8_t reply[5];
+  assertTrue(run_transaction_ok(Commands::FINALIZE_FLASH, dataout, sizeof(dataout), reply, READ_EXACTLY(sizeof(reply)), READ_EXACTLY(1)), "", false);
+  *crc = (uint32_t)reply[1] << 24 | (uint32_t)reply[2] << 16 | (uint32_t)reply[3] << 8 | reply[4];
+  return true;
+}
+
+bool check_manifest(uint32_t len, uint32_t crc, uint8_t *tag) {
+  uint8_t manifest[8 + MANIFEST_TAG_SIZE];
+  assertTrue(run_transaction_ok(Commands::GET_IMAGE_MANIFEST, nullptr, 0, manifest, READ_EXACTLY(sizeof(manifest))), "", false);
+  assertEqual((uint32_t)manifest[0] << 24 | (uint32_t)manifest[1] << 16 | (uint32_t)manifest[2] << 8 | manifest[3], len, "", false);
+  assertEqual((uint32_t)manifest[4] << 24 | (uint32_t)manifest[5] << 16 | (uint32_t)manifest[6] << 8 | manifest[7], crc, "", false);
+  for (uint8_t i = 0; i < MANIFEST_TAG_SIZE; ++i)
+    assertEqual(manifest[8 + i], tag[i], "", false);
+  return true;
+}
+
+test(160_image_manifest) {
+  uint8_t status;
+  uint8_t tag[MANIFEST_TAG_SIZE];
+  for (uint8_t i = 0; i < sizeof(tag); ++i)
+    tag[i] = random();
+
+  if (!SUPPORTS_IMAGE_MANIFEST) {
+    assertTrue(check_command_not_supported(Commands::GET_IMAGE_MANIFEST));
+    uint8_t dataout[1 + MANIFEST_TAG_SIZE] = {FINALIZE_STORE_MANIFEST};
+    assertTrue(run_transaction(Commands::FINALIZE_FLASH, dataout, sizeof(dataout), &status));
+    assertEqual(status, Status::INVALID_ARGUMENTS);
+    return;
+  }
+
+  // Missing tag
+  uint8_t flags = FINALIZE_STORE_MANIFEST;
+  assertTrue(run_transaction(Commands::FINALIZE_FLASH, &flags, sizeof(flags), &status));
+  assertEqual(status, Status::INVALID_ARGUMENTS);
+
+  // Rewrite the current contents, which should not erase anything but
+  // does update the manifest
+  uint8_t data[32];
+  uint8_t dataout[3] = {0, 0, sizeof(data)};
+  assertTrue(run_transaction_ok(Commands::READ_FLASH, dataout, sizeof(dataout), data, READ_EXACTLY(sizeof(data))));
+
+  uint8_t reason;
+  assertTrue(write_flash_cmd(0, data, sizeof(data), &status, &reason));
+  assertOk(status);
+  uint32_t crc;
+  assertTrue(finalize_with_manifest(tag, &crc));
+  assertTrue(check_manifest(sizeof(data), crc, tag));
+
+  if (cfg.skipWrite)
+    return;
+
+  // Changing the image should invalidate the manifest. This rewrites
+  // an entire erase page, so the original contents can be restored
+  // afterwards.
+  static uint8_t page[FLASH_ERASE_SIZE];
+  assertTrue(read_flash(0, page, sizeof(page)));
+
+  uint8_t erase_count;
+  page[sizeof(page) - 1] ^= 0xff;
+  assertTrue(write_flash(page, sizeof(page), MAX_WRITE_DATA_LEN, &erase_count));
+  assertEqual(erase_count, 1);
+  assertTrue(run_transaction_ok(Commands::GET_IMAGE_MANIFEST, nullptr, 0, nullptr, READ_EXACTLY(0)));
+
+  // Restore the original contents and manifest
+  page[sizeof(page) - 1] ^= 0xff;
+  assertTrue(write_flash(page, sizeof(page), MAX_WRITE_DATA_LEN, &erase_count));
+  assertEqual(erase_count, 1);
+  assertTrue(finalize_with_manifest(tag, &crc));
+  assertTrue(check_manifest(sizeof(page), crc, tag));
+}
+
+bool check_page_digest(uint16_t page, uint8_t *data) {
+  Crc32 crc;
+  for (uint16_t i = 0; i < FLASH_ERASE_SIZE; ++i)
+    crc.update(data[i]);
+
+  uint8_t dataout[3] = {(uint8_t)(page >> 8), (uint8_t)page, 1};
+  uint8_t reply[6];
+  assertTrue(run_transaction_ok(Commands::GET_PAGE_DIGESTS, dataout, sizeof(dataout), reply, READ_EXACTLY(sizeof(reply))), "", false);
+  assertEqual((uint16_t)(reply[0] << 8 | reply[1]), FLASH_ERASE_SIZE, "", false);
+  assertEqual((uint32_t)reply[2] << 24 | (uint32_t)reply[3] << 16 | (uint32_t)reply[4] << 8 | reply[5], ~crc.get(), "", false);
+  return true;
+}
+
+test(170_page_digests) {
+  if (!SUPPORTS_PAGE_DIGESTS) {
+    assertTrue(check_command_not_supported(Commands::GET_PAGE_DIGESTS));
+    return;
+  }
+
+  uint8_t status;
+  // Too many digests to fit in a reply
+  uint8_t dataout[3] = {0, 0, (MAX_READ_DATA_LEN - 2) / 4 + 1};
+  assertTrue(run_transaction(Commands::GET_PAGE_DIGESTS, dataout, sizeof(dataout), &status));
+  assertEqual(status, Status::INVALID_ARGUMENTS);
+
+  // Only pages that exist are returned
+  const uint16_t num_pages = AVAILABLE_FLASH_SIZE / FLASH_ERASE_SIZE;
+  uint8_t reply[2 + 4];
+  dataout[0] = (num_pages - 1) >> 8;
+  dataout[1] = (num_pages - 1);
+  dataout[2] = 2;
+  assertTrue(run_transaction_ok(Commands::GET_PAGE_DIGESTS, dataout, sizeof(dataout), reply, READ_EXACTLY(2 + 4)));
+  dataout[0] = num_pages >> 8;
+  dataout[1] = num_pages;
+  assertTrue(run_transaction_ok(Commands::GET_PAGE_DIGESTS, dataout, sizeof(dataout), reply, READ_EXACTLY(2)));
+
+  static uint8_t page[FLASH_ERASE_SIZE];
+  assertTrue(read_flash(0, page, sizeof(page)));
+  assertTrue(check_page_digest(0, page));
+
+  if (cfg.skipWrite)
+    return;
+
+  // Rewriting the page should update its digest
+  uint8_t erase_count;
+  page[0] ^= 0xff;
+  assertTrue(write_flash(page, sizeof(page), MAX_WRITE_DATA_LEN, &erase_count));
+  assertEqual(erase_count, 1);
+  assertTrue(check_page_digest(0, page));
+
+  // Restore the original contents, pausing halfway the page so its
+  // digest is calculated while idle. It should not become stale when
+  // the rest of the page is written.
+  page[0] ^= 0xff;
+  uint16_t offset = 0;
+  uint8_t reason;
+  while (offset < sizeof(page)) {
+    if (offset == sizeof(page) / 2) {
+      delay(100);
+      static uint8_t current[FLASH_ERASE_SIZE];
+      assertTrue(read_flash(0, current, sizeof(current)));
+      assertTrue(check_page_digest(0, current));
+    }
+    uint16_t end = offset < sizeof(page) / 2 ? sizeof(page) / 2 : sizeof(page);
+    uint8_t nextlen = min(MAX_WRITE_DATA_LEN, end - offset);
+    assertTrue(write_flash_cmd(offset, page + offset, nextlen, &status, &reason));
+    assertOk(status);
+    offset += nextlen;
+  }
+  assertTrue(run_transaction_ok(Commands::FINALIZE_FLASH, nullptr, 0, &erase_count, READ_EXACTLY(1)));
+  assertEqual(erase_count, 1);
+  assertTrue(check_page_digest(0, page));
+}
+
+bool resume_flash(uint8_t *tag, uint32_t *address) {
+  uint8_t reply[4];
+  assertTrue(run_transaction_ok(Commands::RESUME_FLASH, tag, MANIFEST_TAG_SIZE, reply, READ_EXACTLY(sizeof(reply))), "", false);
+  *address = (uint32_t)reply[0] << 24 | (uint32_t)reply[1] << 16 | (uint32_t)reply[2] << 8 | reply[3];
+  return true;
+}
+
+test(180_resume_flash) {
+  uint8_t tag[MANIFEST_TAG_SIZE];
+  for (uint8_t i = 0; i < sizeof(tag); ++i)
+    tag[i] = random();
+
+  if (!SUPPORTS_RESUME_FLASH) {
+    assertTrue(check_command_not_supported(Commands::RESUME_FLASH));
+    return;
+  }
+
+  uint8_t status;
+  assertTrue(run_transaction(Commands::RESUME_FLASH, tag, sizeof(tag) - 1, &status));
+  assertEqual(status, Status::INVALID_ARGUMENTS);
+
+  // A new tag starts a new upload
+  uint32_t address;
+  assertTrue(resume_flash(tag, &address));
+  assertEqual(address, 0);
+
+  uint8_t erase_count;
+  if (cfg.skipWrite) {
+    assertTrue(run_transaction_ok(Commands::FINALIZE_FLASH, nullptr, 0, &erase_count, READ_EXACTLY(1), READ_EXACTLY(1)));
+    return;
+  }
+
+  // Change the first page, which should be recorded as progress
+  static uint8_t page[FLASH_ERASE_SIZE];
+  assertTrue(read_flash(0, page, sizeof(page)));
+  page[0] ^= 0xff;
+  uint16_t offset = 0;
+  while (offset < sizeof(page)) {
+    uint8_t nextlen = min(MAX_WRITE_DATA_LEN, sizeof(page) - offset);
+    uint8_t reason;
+    assertTrue(write_flash_cmd(offset, page + offset, nextlen, &status, &reason));
+    assertOk(status);
+    offset += nextlen;
+  }
+
+  // Resuming with the same tag continues after the page, with
+  // another tag it starts over
+  assertTrue(resume_flash(tag, &address));
+  assertEqual(address, FLASH_ERASE_SIZE);
+  tag[0] ^= 0xff;
+  assertTrue(resume_flash(tag, &address));
+  assertEqual(address, 0);
+
+  // Restore the original contents, finalizing ends the upload
+  page[0] ^= 0xff;
+  assertTrue(write_flash(page, sizeof(page), MAX_WRITE_DATA_LEN, &erase_count));
+  assertEqual(erase_count, 2);
+  assertTrue(resume_flash(tag, &address));
+  assertEqual(address, 0);
+  assertTrue(run_transaction_ok(Commands::FINALIZE_FLASH, nullptr, 0, &erase_count, READ_EXACTLY(1), READ_EXACTLY(1)));
+  assertEqual(erase_count, 0);
+}
+
+#if defined(TIME_BOOT)
+// Returns whether the bootloader responds, without failing the test
+// when it does not
+bool probe_bootloader() {
+  #if defined(USE_I2C)
+  bool ack = (bus.startWrite(cfg.curAddr) == SoftWire::ack);
+  bus.stop();
+  return ack;
+  #elif defined(USE_RS485)
+  if (!write_command(Commands::GET_PROTOCOL_VERSION, nullptr, 0))
+    return false;
+  uint8_t addr;
+  if (!read_byte(&addr, 1000))
+    return false;
+  // Discard the rest of the reply
+  delay(1);
+  while (bus.read() >= 0) /* nothing */;
+  bus.endOfTransaction();
+  return true;
+  #endif
+}
+
+// Resets the child using its reset pin and returns the time (in μs)
+// until the bootloader responds, or 0 when it does not respond within
+// 100ms.
+uint32_t time_cold_boot() {
+  digitalWrite(CHILD_RESET_PIN, LOW);
+  pinMode(CHILD_RESET_PIN, OUTPUT);
+  delay(1);
+  pinMode(CHILD_RESET_PIN, INPUT);
+  uint32_t start = micros();
+  while (micros() - start < 100000) {
+    if (probe_bootloader())
+      return micros() - start;
+  }
+  return 0;
+}
+
+test(190_boot_time) {
+  if (!cfg.resetAddr) {
+    skip();
+    return;
+  }
+
+  // After a reset, the child listens to the reset address, and only
+  // with child select asserted. Asserting child select also prevents
+  // a fast boot.
+  cfg.curAddr = cfg.resetAddr;
+  set_child_select(true);
+  uint32_t ready = time_cold_boot();
+  assertNotEqual(ready, 0);
+
+  // Without fast boot, the application starts only after the master
+  // has found the child and checked its manifest (START_APPLICATION
+  // is not sent, since the flash contents are not a valid
+  // application).
+  uint32_t start = micros();
+  if (SUPPORTS_IMAGE_MANIFEST) {
+    uint8_t manifest[8 + MANIFEST_TAG_SIZE];
+    assertTrue(run_transaction_ok(Commands::GET_IMAGE_MANIFEST, nullptr, 0, manifest, READ_UP_TO(sizeof(manifest))));
+  }
+  uint32_t check = micros() - start;
+
+  Serial.print("Bootloader ready after ");
+  Serial.print(ready);
+  Serial.print("us, checking the manifest took ");
+  Serial.print(check);
+  Serial.println("us");
+}
+#endif // defined(TIME_BOOT)
+
+test(200_boot_timestamps) {
+  if (!SUPPORTS_BOOT_TIMESTAMPS) {
+    assertTrue(check_command_not_supported(Commands::GET_BOOT_TIMESTAMPS));
+    return;
+  }
+
+  const uint8_t NUM_TIMESTAMPS = 6;
+  uint8_t reply[NUM_TIMESTAMPS * 4];
+  assertTrue(run_transaction_ok(Commands::GET_BOOT_TIMESTAMPS, nullptr, 0, reply, READ_EXACTLY(sizeof(reply))));
+
+  // Since we are talking to it, all points except the (optional)
+  // oscillator should be reached, in order
+  uint32_t prev = 0;
+  for (uint8_t i = 0; i < NUM_TIMESTAMPS; ++i) {
+    uint32_t timestamp = (uint32_t)reply[i * 4] << 24 | (uint32_t)reply[i * 4 + 1] << 16 | (uint32_t)reply[i * 4 + 2] << 8 | reply[i * 4 + 3];
+    Serial.print("Boot timestamp ");
+    Serial.print(i);
+    Serial.print(": ");
+    Serial.print(timestamp);
+    Serial.println("us");
+
+    if (i == 0 && timestamp == 0)
+      continue;
+    assertNotEqual(timestamp, 0);
+    assertMoreOrEqual(timestamp, prev);
+    prev = timestamp;
+  }
+}
+
+test(210_command_stats) {
+  if (!SUPPORTS_COMMAND_STATS) {
+    assertTrue(check_command_not_supported(Commands::GET_COMMAND_STATS));
+    return;
+  }
+
+  const uint8_t NUM_BUCKETS = 8;
+  uint8_t reply[10 + NUM_BUCKETS * 2];
+  uint8_t status;
+  uint8_t dataout[2] = {Commands::GET_PROTOCOL_VERSION, 0x01 /* reset */};
+  assertTrue(run_transaction_ok(Commands::GET_COMMAND_STATS, dataout, sizeof(dataout), reply, READ_EXACTLY(sizeof(reply))));
+
+  const uint8_t count = 5;
+  for (uint8_t i = 0; i < count; ++i) {
+    uint8_t version[2];
+    assertTrue(run_transaction_ok(Commands::GET_PROTOCOL_VERSION, nullptr, 0, version, READ_EXACTLY(sizeof(version))));
+  }
+
+  assertTrue(run_transaction_ok(Commands::GET_COMMAND_STATS, dataout, sizeof(dataout), reply, READ_EXACTLY(sizeof(reply))));
+  uint16_t reply_count = reply[0] << 8 | reply[1];
+  uint32_t min = (uint32_t)reply[2] << 24 | (uint32_t)reply[3] << 16 | (uint32_t)reply[4] << 8 | reply[5];
+  uint32_t max = (uint32_t)reply[6] << 24 | (uint32_t)reply[7] << 16 | (uint32_t)reply[8] << 8 | reply[9];
+  uint16_t bucket_total = 0;
+  for (uint8_t i = 0; i < NUM_BUCKETS; ++i)
+    bucket_total += reply[10 + i * 2] << 8 | reply[11 + i * 2];
+  assertEqual(reply_count, count);
+  assertEqual(bucket_total, count);
+  assertLessOrEqual(min, max);
+  // Such a simple command should never come close to the limit
+  assertLess(max, 1000U);
+
+  // The previous request reset the statistics
+  assertTrue(run_transaction_ok(Commands::GET_COMMAND_STATS, dataout, sizeof(dataout), reply, READ_EXACTLY(sizeof(reply))));
+  assertEqual(reply[0], 0);
+  assertEqual(reply[1], 0);
+
+  // Commands that are not tracked
+  dataout[0] = 0xff;
+  assertTrue(run_transaction(Commands::GET_COMMAND_STATS, dataout, sizeof(dataout), &status));
+  assertEqual(status, Status::INVALID_ARGUMENTS);
+}
+
+bool get_bus_stats(uint32_t *counters, uint8_t count, uint8_t flags) {
+  uint8_t reply[count * 4];
+  if (!run_transaction_ok(Commands::GET_BUS_STATS, &flags, 1, reply, READ_EXACTLY(sizeof(reply))))
+    return false;
+  for (uint8_t i = 0; i < count; ++i)
+    counters[i] = (uint32_t)reply[i * 4] << 24 | (uint32_t)reply[i * 4 + 1] << 16 | (uint32_t)reply[i * 4 + 2] << 8 | reply[i * 4 + 3];
+  return true;
+}
+
+test(220_bus_stats) {
+  if (!SUPPORTS_BUS_STATS) {
+    assertTrue(check_command_not_supported(Commands::GET_BUS_STATS));
+    return;
+  }
+
+  enum { FRAMES_SEEN, FRAMES_ADDRESSED, BYTES_RECEIVED, BYTES_SENT, PARITY_ERRORS, FRAMING_ERRORS, OVERRUN_ERRORS, RX_OVERFLOWS, CRC_ERRORS, REPLIES_SUPPRESSED, NUM_COUNTERS };
+  uint32_t counters[NUM_COUNTERS];
+  assertTrue(get_bus_stats(counters, NUM_COUNTERS, 0x01 /* clear */));
+
+  // A valid request and reply
+  uint8_t version[2];
+  assertTrue(run_transaction_ok(Commands::GET_PROTOCOL_VERSION, nullptr, 0, version, READ_EXACTLY(sizeof(version))));
+
+  // A request with a bad CRC
+  uint8_t crc_xor = random(1, 256);
+  assertTrue(write_command(Commands::GET_PROTOCOL_VERSION, nullptr, 0, crc_xor));
+  #if defined(USE_I2C)
+    uint8_t status;
+    assertTrue(read_status(&status, nullptr, READ_EXACTLY(0), READ_EXACTLY(0)));
+    assertEqual(status, Status::INVALID_CRC);
+  #elif defined(USE_RS485)
+    assertNoResponse();
+  #endif
+
+  assertTrue(get_bus_stats(counters, NUM_COUNTERS, 0));
+  assertEqual(counters[CRC_ERRORS], 1U);
+  assertEqual(counters[REPLIES_SUPPRESSED], 0U);
+
+  #if defined(USE_RS485)
+    // This includes the bus stats request itself, and the reply to
+    // the clear request, which was counted after clearing
+    assertMoreOrEqual(counters[FRAMES_SEEN], 3U);
+    assertEqual(counters[FRAMES_ADDRESSED], 3U);
+    assertEqual(counters[PARITY_ERRORS], 0U);
+    assertEqual(counters[FRAMING_ERRORS], 0U);
+    assertEqual(counters[OVERRUN_ERRORS], 0U);
+    assertEqual(counters[RX_OVERFLOWS], 0U);
+    assertNotEqual(counters[BYTES_RECEIVED], 0U);
+    assertNotEqual(counters[BYTES_SENT], 0U);
+  #endif
+}
+
+test(230_ram_usage) {
+  if (!SUPPORTS_RAM_USAGE) {
+    assertTrue(check_command_not_supported(Commands::GET_RAM_USAGE));
+    return;
+  }
+
+  uint8_t reply[6];
+  assertTrue(run_transaction_ok(Commands::GET_RAM_USAGE, nullptr, 0, reply, READ_EXACTLY(sizeof(reply))));
+  uint16_t total = reply[0] << 8 | reply[1];
+  uint16_t statics = reply[2] << 8 | reply[3];
+  uint16_t stack = reply[4] << 8 | reply[5];
+
+  Serial.print("RAM: ");
+  Serial.print(statics);
+  Serial.print(" static, ");
+  Serial.print(stack);
+  Serial.print(" stack, ");
+  Serial.print(total - statics - stack);
+  Serial.print(" free of ");
+  Serial.println(total);
+
+  // The stack has certainly been used to process this command
+  assertNotEqual(stack, 0);
+  assertLessOrEqual(statics + stack, total);
+}
+
+test(235_batch) {
+  if (!SUPPORTS_BATCH) {
+    assertTrue(check_command_not_supported(Commands::BATCH));
+    return;
+  }
+
+  // The last command must not run, since the one before it fails
+  uint8_t cmds[] = {
+    Commands::GET_PROTOCOL_VERSION, 0,
+    Commands::GET_MAX_PACKET_LENGTH, 0,
+    0x7f, 0,
+    Commands::GET_PROTOCOL_VERSION, 0,
+  };
+  uint8_t expected[] = {
+    Status::COMMAND_OK, 2, PROTOCOL_VERSION >> 8, PROTOCOL_VERSION & 0xff,
+    Status::COMMAND_OK, 2, MAX_MSG_LEN >> 8, MAX_MSG_LEN & 0xff,
+    Status::COMMAND_NOT_SUPPORTED, 0,
+  };
+  uint8_t reply[sizeof(expected)];
+  assertTrue(run_transaction_ok(Commands::BATCH, cmds, sizeof(cmds), reply, READ_EXACTLY(sizeof(reply))));
+  assertEqual(memcmp(reply, expected, sizeof(expected)), 0);
+
+  // Truncated sub-command
+  uint8_t status;
+  uint8_t truncated[] = {Commands::GET_PROTOCOL_VERSION, 1};
+  assertTrue(run_transaction(Commands::BATCH, truncated, sizeof(truncated), &status));
+  assertEqual(status, Status::INVALID_ARGUMENTS);
+}
+
+test(236_device_descriptor) {
+  if (!SUPPORTS_DEVICE_DESCRIPTOR) {
+    assertTrue(check_command_not_supported(Commands::GET_DEVICE_DESCRIPTOR));
+    return;
+  }
+
+  uint8_t data[MAX_MSG_LEN];
+  uint8_t len;
+  assertTrue(run_transaction_ok(Commands::GET_DEVICE_DESCRIPTOR, nullptr, 0, data, READ_UP_TO(sizeof(data)), READ_EXACTLY(0), &len));
+
+  assertMoreOrEqual(len, 13);
+  assertEqual((uint16_t)(data[0] << 8 | data[1]), PROTOCOL_VERSION);
+  assertEqual(data[2], HARDWARE_TYPE);
+  assertEqual(data[3], HARDWARE_COMPATIBLE_REVISION);
+  assertEqual(data[4], HARDWARE_REVISION);
+  assertEqual(data[5], BOOTLOADER_VERSION);
+  uint32_t flash_size = (uint32_t)data[6] << 24 | (uint32_t)data[7] << 16 | data[8] << 8 | data[9];
+  assertEqual(flash_size, AVAILABLE_FLASH_SIZE);
+  assertEqual((uint16_t)(data[10] << 8 | data[11]), MAX_MSG_LEN);
+  uint8_t pos = 12;
+
+  // Serial number should match GET_SERIAL_NUMBER
+  uint8_t serial[16];
+  uint8_t serial_len;
+  assertTrue(run_transaction_ok(Commands::GET_SERIAL_NUMBER, nullptr, 0, serial, READ_UP_TO(sizeof(serial)), READ_EXACTLY(0), &serial_len));
+  assertEqual(data[pos++], serial_len);
+  assertMoreOrEqual(len, pos + serial_len + 1);
+  assertEqual(memcmp(data + pos, serial, serial_len), 0);
+  pos += serial_len;
+
+  assertEqual(data[pos++], sizeof(EXTRA_INFO));
+  assertMoreOrEqual(len, pos + sizeof(EXTRA_INFO) + 6);
+  assertEqual(memcmp(data + pos, EXTRA_INFO, sizeof(EXTRA_INFO)), 0);
+  // The board info signature and CRC follow, which depend on the
+  // board info written, so are not checked
+}
+
+test(237_capabilities) {
+  if (!SUPPORTS_CAPABILITIES) {
+    assertTrue(check_command_not_supported(Commands::GET_CAPABILITIES));
+    return;
+  }
+
+  uint8_t data[12];
+  assertTrue(run_transaction_ok(Commands::GET_CAPABILITIES, nullptr, 0, data, READ_EXACTLY(sizeof(data))));
+
+  uint32_t caps = (uint32_t)data[0] << 24 | (uint32_t)data[1] << 16 | (uint32_t)data[2] << 8 | data[3];
+  assertEqual((bool)(caps & Capabilities::DISPLAY), SUPPORTS_DISPLAY);
+  assertEqual((bool)(caps & Capabilities::CHILD_SELECT), NUM_CHILDREN > 0);
+  assertEqual((bool)(caps & Capabilities::EXTENDED_ADDRESSING), SUPPORTS_EXTENDED_ADDRESSING);
+  assertEqual((bool)(caps & Capabilities::FINALIZE_CRC), SUPPORTS_FINALIZE_CRC);
+  assertEqual((bool)(caps & Capabilities::IMAGE_MANIFEST), SUPPORTS_IMAGE_MANIFEST);
+  assertEqual((bool)(caps & Capabilities::PAGE_DIGESTS), SUPPORTS_PAGE_DIGESTS);
+  assertEqual((bool)(caps & Capabilities::RESUME_FLASH), SUPPORTS_RESUME_FLASH);
+  assertEqual((bool)(caps & Capabilities::BOOT_TIMESTAMPS), SUPPORTS_BOOT_TIMESTAMPS);
+  assertEqual((bool)(caps & Capabilities::COMMAND_STATS), SUPPORTS_COMMAND_STATS);
+  assertEqual((bool)(caps & Capabilities::BUS_STATS), SUPPORTS_BUS_STATS);
+  assertEqual((bool)(caps & Capabilities::RAM_USAGE), SUPPORTS_RAM_USAGE);
+  assertEqual((bool)(caps & Capabilities::BATCH), SUPPORTS_BATCH);
+  assertEqual((bool)(caps & Capabilities::DEVICE_DESCRIPTOR), SUPPORTS_DEVICE_DESCRIPTOR);
+  #if defined(USE_RS485)
+  assertEqual((bool)(caps & Capabilities::SLOTTED_QUERY), SUPPORTS_SLOTTED_QUERY);
+  assertEqual((bool)(caps & Capabilities::SERIAL_SEARCH), SUPPORTS_SERIAL_SEARCH);
+  assertEqual((bool)(caps & Capabilities::STREAMING), false);
+  #else
+  assertEqual((bool)(caps & Capabilities::SLOTTED_QUERY), false);
+  assertEqual((bool)(caps & Capabilities::SERIAL_SEARCH), false);
+  assertEqual((bool)(caps & Capabilities::STREAMING), SUPPORTS_STREAMING);
+  #endif
+
+  assertEqual((uint16_t)(data[4] << 8 | data[5]), FLASH_ERASE_SIZE);
+  uint16_t write_size = data[6] << 8 | data[7];
+  assertNotEqual(write_size, 0);
+  assertEqual(FLASH_ERASE_SIZE % write_size, 0);
+}
+
+#if defined(USE_RS485)
+bool write_general_call(uint8_t cmd, uint8_t *data, uint8_t len) {
+  uint8_t old = cfg.curAddr;
+  cfg.curAddr = GENERAL_CALL_ADDRESS;
+  bool result = write_command(cmd, data, len);
+  cfg.curAddr = old;
+  return result;
+}
+
+bool write_slotted_query(uint8_t first, uint8_t count, uint8_t slotLength, uint8_t cmd) {
+  uint8_t data[] = {first, count, slotLength, cmd};
+  return write_general_call(GeneralCallCommands::SLOTTED_QUERY, data, sizeof(data));
+}
+
+test(238_slotted_query) {
+  if (!SUPPORTS_SLOTTED_QUERY || cfg.curAddr < 2 || (cfg.curAddr >= FIRST_ADDRESS && cfg.curAddr <= LAST_ADDRESS)) {
+    // Only children with a configured address have a slot (and
+    // this needs two addresses below it)
+    skip();
+    return;
+  }
+
+  // Address, status, length, version and CRC
+  const uint8_t slotLength = 7;
+  uint8_t status;
+  uint8_t data[2];
+
+  // In the first slot
+  assertTrue(write_slotted_query(cfg.curAddr, 1, slotLength, Commands::GET_PROTOCOL_VERSION));
+  assertTrue(read_status(&status, data, READ_EXACTLY(sizeof(data)), READ_EXACTLY(0)));
+  assertOk(status);
+  assertEqual((uint16_t)(data[0] << 8 | data[1]), PROTOCOL_VERSION);
+
+  // In the third slot
+  assertTrue(write_slotted_query(cfg.curAddr - 2, 3, slotLength, Commands::GET_PROTOCOL_VERSION));
+  assertTrue(read_status(&status, data, READ_EXACTLY(sizeof(data)), READ_EXACTLY(0)));
+  assertOk(status);
+  assertEqual((uint16_t)(data[0] << 8 | data[1]), PROTOCOL_VERSION);
+
+  // Reply does not fit in the slot
+  assertTrue(write_slotted_query(cfg.curAddr, 1, slotLength - 1, Commands::GET_PROTOCOL_VERSION));
+  assertNoResponse();
+
+  // Address is past the last slot
+  assertTrue(write_slotted_query(cfg.curAddr - 2, 2, slotLength, Commands::GET_PROTOCOL_VERSION));
+  assertNoResponse();
+
+  // Would set the same address on all children
+  assertTrue(write_slotted_query(cfg.curAddr, 1, slotLength, Commands::SET_ADDRESS));
+  assertNoResponse();
+}
+
+bool search_serial(uint8_t *prefix, uint8_t bits, uint8_t *serial, uint8_t len) {
+  uint8_t data[1 + 16];
+  assertLessOrEqual((bits + 7) / 8, sizeof(data) - 1, "", false);
+  data[0] = bits;
+  memcpy(data + 1, prefix, (bits + 7) / 8);
+  assertTrue(write_general_call(GeneralCallCommands::SEARCH_SERIAL, data, 1 + (bits + 7) / 8), "", false);
+
+  // The reply comes from the general call address
+  uint8_t old = cfg.curAddr;
+  cfg.curAddr = GENERAL_CALL_ADDRESS;
+  uint8_t status;
+  bool result = read_status(&status, serial, READ_EXACTLY(len), READ_EXACTLY(0));
+  cfg.curAddr = old;
+  assertTrue(result, "", false);
+  assertOk(status, "", false);
+  return true;
+}
+
+test(239_serial_search) {
+  if (!SUPPORTS_SERIAL_SEARCH || !cfg.curAddr || (cfg.curAddr >= FIRST_ADDRESS && cfg.curAddr <= LAST_ADDRESS)) {
+    // Needs a configured address to restore afterwards
+    skip();
+    return;
+  }
+
+  #if defined(TEST_SUBJECT_ATTINY)
+    uint8_t serial[9];
+  #elif defined(TEST_SUBJECT_STM32)
+    uint8_t serial[12];
+  #endif
+  assertTrue(run_transaction_ok(Commands::GET_SERIAL_NUMBER, nullptr, 0, serial, READ_EXACTLY(sizeof(serial))));
+
+  // Children with an address do not take part
+  uint8_t prefix[sizeof(serial)];
+  uint8_t empty = 0;
+  assertTrue(write_general_call(GeneralCallCommands::SEARCH_SERIAL, &empty, 1));
+  assertNoResponse();
+
+  assertTrue(write_general_call(GeneralCallCommands::RESET_ADDRESS, nullptr, 0));
+
+  // Empty, partial and full prefixes match
+  uint8_t found[sizeof(serial)];
+  assertTrue(search_serial(prefix, 0, found, sizeof(found)));
+  assertEqual(memcmp(found, serial, sizeof(serial)), 0);
+
+  memcpy(prefix, serial, sizeof(serial));
+  prefix[1] ^= 0x01; // Outside of the prefix
+  assertTrue(search_serial(prefix, 15, found, sizeof(found)));
+  assertEqual(memcmp(found, serial, sizeof(serial)), 0);
+
+  assertTrue(search_serial(serial, sizeof(serial) * 8, found, sizeof(found)));
+  assertEqual(memcmp(found, serial, sizeof(serial)), 0);
+
+  // Differs in the last prefix bit
+  uint8_t data[sizeof(serial) + 1];
+  data[0] = 16;
+  memcpy(data + 1, prefix, 2);
+  assertTrue(write_general_call(GeneralCallCommands::SEARCH_SERIAL, data, 3));
+  assertNoResponse();
+
+  // Truncated serial number
+  data[0] = cfg.curAddr;
+  data[1] = 0;
+  memcpy(data + 2, serial, sizeof(serial) - 1);
+  assertTrue(write_general_call(GeneralCallCommands::SET_ADDRESS_BY_SERIAL, data, sizeof(serial) + 1));
+  assertNoResponse();
+
+  uint8_t setaddr[sizeof(serial) + 2];
+  setaddr[0] = cfg.curAddr;
+  setaddr[1] = 0;
+  // Other serial number
+  memcpy(setaddr + 2, prefix, sizeof(serial));
+  assertTrue(write_general_call(GeneralCallCommands::SET_ADDRESS_BY_SERIAL, setaddr, sizeof(setaddr)));
+  assertNoResponse();
+
+  // Restore the address
+  memcpy(setaddr + 2, serial, sizeof(serial));
+  assertTrue(write_general_call(GeneralCallCommands::SET_ADDRESS_BY_SERIAL, setaddr, sizeof(setaddr)));
+  uint8_t status;
+  assertTrue(read_status(&status, nullptr, READ_EXACTLY(0), READ_EXACTLY(0)));
+  assertOk(status);
+
+  assertTrue(check_responds_to(cfg.curAddr));
+}
+#endif // defined(USE_RS485)
+
+#if defined(USE_I2C)
+test(240_stream_flash) {
+  if (!SUPPORTS_STREAMING) {
+    assertTrue(check_command_not_supported(Commands::STREAM_FLASH));
+    return;
+  }
+
+  const uint16_t len = 300;
+  uint8_t args[] = {STREAM_READ, 0, 0, 0, 0, 0, 0, len >> 8, len & 0xff};
+  uint8_t status;
+
+  // Invalid mode
+  args[0] = 0;
+  assertTrue(run_transaction(Commands::STREAM_FLASH, args, sizeof(args), &status));
+  assertEqual(status, Status::INVALID_ARGUMENTS);
+  args[0] = STREAM_READ;
+
+  // Missing length
+  assertTrue(run_transaction(Commands::STREAM_FLASH, args, 5, &status));
+  assertEqual(status, Status::INVALID_ARGUMENTS);
+
+  // Read stream, the reply is directly followed by data and CRC
+  static uint8_t expected[len], data[len];
+  assertTrue(read_flash(0, expected, len));
+  assertTrue(write_command(Commands::STREAM_FLASH, args, sizeof(args)));
+  assertAck(bus.startRead(cfg.curAddr));
+  uint8_t reply[3];
+  for (uint8_t i = 0; i < sizeof(reply); ++i)
+    assertAck(bus.readThenAck(reply[i]));
+  assertOk(reply[0]);
+  assertEqual(reply[1], 0);
+  assertEqual(reply[2], Crc8Ccitt().update(reply, 2).get());
+
+  Crc16Ccitt crc;
+  for (uint16_t i = 0; i < len; ++i) {
+    assertAck(bus.readThenAck(data[i]));
+    crc.update(data[i]);
+  }
+  uint8_t crc_msb, crc_lsb;
+  assertAck(bus.readThenAck(crc_msb));
+  assertAck(bus.readThenNack(crc_lsb));
+  bus.stop();
+  assertEqual(memcmp(data, expected, len), 0);
+  assertEqual((uint16_t)(crc_msb << 8 | crc_lsb), crc.get());
+
+  if (cfg.skipWrite)
+    return;
+
+  // Write stream of the same data, so nothing needs to be erased
+  args[0] = STREAM_WRITE;
+  assertTrue(run_transaction_ok(Commands::STREAM_FLASH, args, sizeof(args), nullptr, READ_EXACTLY(0)));
+  assertAck(bus.startWrite(cfg.curAddr));
+  for (uint16_t i = 0; i < len; ++i)
+    assertAck(bus.llWrite(expected[i]));
+  bus.stop();
+  uint8_t reason;
+  assertTrue(read_status(&status, &reason, READ_EXACTLY(0), READ_EXACTLY(1)));
+  assertOk(status);
+
+  uint8_t erase_count;
+  assertTrue(run_transaction_ok(Commands::FINALIZE_FLASH, nullptr, 0, &erase_count, READ_EXACTLY(1)));
+  assertEqual(erase_count, 0);
+
+  // A write transaction without data cancels the stream
+  assertTrue(run_transaction_ok(Commands::STREAM_FLASH, args, sizeof(args), nullptr, READ_EXACTLY(0)));
+  assertAck(bus.startWrite(cfg.curAddr));
+  bus.stop();
+  assertTrue(read_status(&status, &reason, READ_EXACTLY(0), READ_EXACTLY(1)));
+  assertEqual(status, Status::INVALID_TRANSFER);
+}
+#endif // defined(USE_I2C)
+
+#if defined(BENCHMARK_LATENCY)
+// Measures response times, e.g. to compare a build that sleeps while
+// idle (with BUS_USE_INTERRUPTS) against one that polls. The child is
+// left idle for a while before each request, so any wakeup delay is
+// included. Measure the current draw of the child during the idle
+// periods separately.
+void print_latency(const char *what, uint32_t min_us, uint32_t total_us, uint32_t max_us, uint16_t count) {
+  Serial.print(what);
+  Serial.print(": min ");
+  Serial.print(min_us);
+  Serial.print("us, avg ");
+  Serial.print(total_us / count);
+  Serial.print("us, max ");
+  Serial.print(max_us);
+  Serial.println("us");
+}
+
+test(250_latency) {
+  const uint16_t count = 100;
+  uint32_t min_us = UINT32_MAX, max_us = 0, total_us = 0;
+
+  // Short request and reply, mostly shows wakeup and turnaround time
+  for (uint16_t i = 0; i < count; ++i) {
+    delay(random(1, 10));
+    uint8_t version[2];
+    uint32_t start = micros();
+    assertTrue(run_transaction_ok(Commands::GET_PROTOCOL_VERSION, nullptr, 0, version, READ_EXACTLY(sizeof(version))));
+    uint32_t duration = micros() - start;
+    min_us = min(min_us, duration);
+    max_us = max(max_us, duration);
+    total_us += duration;
+  }
+  print_latency("GET_PROTOCOL_VERSION", min_us, total_us, max_us, count);
+
+  // Longest reply, mostly shows per-byte time
+  min_us = UINT32_MAX;
+  max_us = total_us = 0;
+  static uint8_t data[MAX_READ_DATA_LEN];
+  for (uint16_t i = 0; i < count; ++i) {
+    delay(random(1, 10));
+    uint32_t start = micros();
+    assertTrue(read_flash(0, data, sizeof(data)));
+    uint32_t duration = micros() - start;
+    min_us = min(min_us, duration);
+    max_us = max(max_us, duration);
+    total_us += duration;
+  }
+  print_latency("READ_FLASH", min_us, total_us, max_us, count);
+}
+
+// Measures READ_FLASH throughput using the 32-byte messages that every
+// child supports and using the biggest messages this child supports,
+// to show the gain of bigger packets. Write throughput can be measured
+// with TIME_WRITE (see write_and_verify_flash).
+test(251_throughput) {
+  const uint16_t len = 1024;
+  const uint16_t msg_lens[] = {32, MAX_MSG_LEN};
+  static uint8_t data[MAX_READ_DATA_LEN];
+
+  for (uint16_t msg_len : msg_lens) {
+    uint8_t readlen = msg_len - (MAX_MSG_LEN - MAX_READ_DATA_LEN);
+    uint32_t start = micros();
+    for (uint16_t offset = 0; offset < len; offset += readlen) {
+      uint8_t nextlen = min(readlen, len - offset);
+      uint8_t readout[3] = {(uint8_t)(offset >> 8), (uint8_t)offset, nextlen};
+      assertTrue(run_transaction_ok(Commands::READ_FLASH, readout, sizeof(readout), data, READ_EXACTLY(nextlen)));
+    }
+    uint32_t duration = micros() - start;
+    Serial.print("READ_FLASH with ");
+    Serial.print(msg_len);
+    Serial.print(" byte messages: ");
+    Serial.print((uint32_t)len * 1000000 / duration);
+    Serial.println(" bytes/s");
+  }
+}
+#endif // defined(BENCHMARK_LATENCY)
+
 void runTests() {
   static uint32_t count = 0;
   long seed = random();
@@ -40,6 +40,9 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 // This should normally be enabled for STM32/RS485 and disabled for ATTINY/I2C
 #define USE_CHILD_SELECT
 
+// Enable when the STM32 bootloader was built with IMAGE_MANIFEST=1
+//#define WITH_IMAGE_MANIFEST
+
 struct Status {
   enum {
     COMMAND_OK            = 0x00,
@@ -68,6 +71,20 @@ struct Commands {
     GET_MAX_PACKET_LENGTH = 0x0c,
     GET_EXTRA_INFO        = 0x0d,
     READ_BOARD_INFO       = 0x0e,
+    WRITE_FLASH_EXTENDED  = 0x0f,
+    READ_FLASH_EXTENDED   = 0x10,
+    GET_FLASH_SIZE        = 0x11,
+    GET_IMAGE_MANIFEST    = 0x12,
+    GET_PAGE_DIGESTS      = 0x13,
+    RESUME_FLASH          = 0x14,
+    GET_BOOT_TIMESTAMPS   = 0x15,
+    GET_COMMAND_STATS     = 0x16,
+    GET_BUS_STATS         = 0x17,
+    GET_RAM_USAGE         = 0x18,
+    BATCH                 = 0x19,
+    GET_DEVICE_DESCRIPTOR = 0x1a,
+    GET_CAPABILITIES      = 0x1b,
+    STREAM_FLASH          = 0x1c,
     END_OF_COMMANDS
   };
 };
@@ -81,6 +98,9 @@ struct GeneralCallCommands {
     // in the 0x40-0x48 "user defined function codes" area.
     static const uint8_t RESET = 0x46;
     static const uint8_t RESET_ADDRESS = 0x44;
+    static const uint8_t SLOTTED_QUERY = 0x47;
+    static const uint8_t SEARCH_SERIAL = 0x48;
+    static const uint8_t SET_ADDRESS_BY_SERIAL = 0x45;
   #endif
 };
 
@@ -89,15 +109,63 @@ static const uint8_t FIRST_ADDRESS = 8;
 static const uint8_t LAST_ADDRESS = 15;
 static const uint8_t MAX_EXTRA_INFO = 16;
 
+// Flags for FINALIZE_FLASH
+static const uint8_t FINALIZE_RETURN_CRC = 0x01;
+static const uint8_t FINALIZE_STORE_MANIFEST = 0x02;
+static const uint8_t MANIFEST_TAG_SIZE = 8;
+
+// Modes for STREAM_FLASH
+static const uint8_t STREAM_WRITE = 0x01;
+static const uint8_t STREAM_READ = 0x02;
+
+// Bits for GET_CAPABILITIES
+struct Capabilities {
+  enum : uint32_t {
+    DISPLAY             = 0x00000001,
+    CHILD_SELECT        = 0x00000002,
+    EXTENDED_ADDRESSING = 0x00000004,
+    FINALIZE_CRC        = 0x00000008,
+    IMAGE_MANIFEST      = 0x00000010,
+    PAGE_DIGESTS        = 0x00000020,
+    RESUME_FLASH        = 0x00000040,
+    BOOT_TIMESTAMPS     = 0x00000080,
+    COMMAND_STATS       = 0x00000100,
+    BUS_STATS           = 0x00000200,
+    RAM_USAGE           = 0x00000400,
+    BATCH               = 0x00000800,
+    DEVICE_DESCRIPTOR   = 0x00001000,
+    SLOTTED_QUERY       = 0x00002000,
+    SERIAL_SEARCH       = 0x00004000,
+    STREAMING           = 0x00008000,
+  };
+};
+
 // Expected values
-static const uint16_t PROTOCOL_VERSION = 0x0202;
+static const uint16_t PROTOCOL_VERSION = 0x0203;
 #if defined(TEST_SUBJECT_ATTINY)
 static const uint8_t HARDWARE_TYPE = 0x01;
 static const uint8_t HARDWARE_COMPATIBLE_REVISION = 0x01;
 static const uint8_t HARDWARE_REVISION = 0x14;
 static const uint16_t AVAILABLE_FLASH_SIZE = 8192-2048-2;
 static const bool SUPPORTS_DISPLAY = true;
+static const bool SUPPORTS_EXTENDED_ADDRESSING = false;
+static const bool SUPPORTS_FINALIZE_CRC = false;
+static const bool SUPPORTS_IMAGE_MANIFEST = false;
+static const bool SUPPORTS_PAGE_DIGESTS = false;
+static const bool SUPPORTS_RESUME_FLASH = false;
+static const bool SUPPORTS_BOOT_TIMESTAMPS = false;
+static const bool SUPPORTS_COMMAND_STATS = false;
+static const bool SUPPORTS_BUS_STATS = false;
+static const bool SUPPORTS_RAM_USAGE = false;
+static const bool SUPPORTS_BATCH = false;
+static const bool SUPPORTS_DEVICE_DESCRIPTOR = false;
+static const bool SUPPORTS_CAPABILITIES = false;
+static const bool SUPPORTS_SLOTTED_QUERY = false;
+static const bool SUPPORTS_SERIAL_SEARCH = false;
+static const bool SUPPORTS_STREAMING = false;
+// Must match PACKET_LENGTH when building the bootloader
 static const uint16_t MAX_MSG_LEN = 32;
+static const uint16_t FLASH_ERASE_SIZE = 64;
 static const uint8_t NUM_CHILDREN = 0;
 static constexpr const uint8_t EXTRA_INFO[] = {0x02};
 #define BOARD_INFO_FILE "board_info/interfaceboard.h"
@@ -105,9 +173,32 @@ static constexpr const uint8_t EXTRA_INFO[] = {0x02};
 static const uint8_t HARDWARE_TYPE = 0x02;
 static const uint8_t HARDWARE_COMPATIBLE_REVISION = 0x10;
 static const uint8_t HARDWARE_REVISION = 0x10;
+#if defined(WITH_IMAGE_MANIFEST)
+// Last page is reserved for metadata
+static const uint16_t AVAILABLE_FLASH_SIZE = 65536-4096-2048;
+static const bool SUPPORTS_IMAGE_MANIFEST = true;
+static const bool SUPPORTS_RESUME_FLASH = true;
+#else
 static const uint16_t AVAILABLE_FLASH_SIZE = 65536-4096;
+static const bool SUPPORTS_IMAGE_MANIFEST = false;
+static const bool SUPPORTS_RESUME_FLASH = false;
+#endif
 static const bool SUPPORTS_DISPLAY = false;
+static const bool SUPPORTS_EXTENDED_ADDRESSING = true;
+static const bool SUPPORTS_FINALIZE_CRC = true;
+static const bool SUPPORTS_PAGE_DIGESTS = true;
+static const bool SUPPORTS_BOOT_TIMESTAMPS = true;
+static const bool SUPPORTS_COMMAND_STATS = true;
+static const bool SUPPORTS_BUS_STATS = true;
+static const bool SUPPORTS_RAM_USAGE = true;
+static const bool SUPPORTS_BATCH = true;
+static const bool SUPPORTS_DEVICE_DESCRIPTOR = true;
+static const bool SUPPORTS_CAPABILITIES = true;
+static const bool SUPPORTS_SLOTTED_QUERY = true;
+static const bool SUPPORTS_SERIAL_SEARCH = true;
+static const bool SUPPORTS_STREAMING = true;
 static const uint16_t MAX_MSG_LEN = 255;
+static const uint16_t FLASH_ERASE_SIZE = 2048;
 static const uint8_t NUM_CHILDREN = 1;
 static const uint8_t EXTRA_INFO[] = {};
 #define BOARD_INFO_FILE "board_info/gphopper.h"
@@ -135,6 +226,10 @@ static const uint16_t DOWNSTREAM_CS_CHECK_PINS[] = {
 static_assert(sizeof(DOWNSTREAM_CS_CHECK_PINS)/sizeof(*DOWNSTREAM_CS_CHECK_PINS) >= NUM_CHILDREN, "Insufficient CS check pins");
 #endif // defined(ARDUINO_STM32_GP20_MAINBOARD)
 
+// To measure boot times, define TIME_BOOT in BootloaderTest.ino and
+// set this to a pin connected to the reset pin of the child
+//static const uint16_t CHILD_RESET_PIN = ...;
+
 #if defined(USE_RS485)
 static const uint32_t BAUD_RATE = 1000000;
 static const int SERIAL_SETTING = SERIAL_8E1;
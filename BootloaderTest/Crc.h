@@ -92,6 +92,19 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  *
  *   uint8_t crc = Crc<...>().update(first_byte).update(rest_of_bytes, len).get();
  */
+// Reflected CRC32 (as used by zlib and ethernet). Note that the final
+// value must be inverted to get the usual result.
+inline uint32_t _crc32_update(uint32_t crc, uint8_t data) {
+  crc ^= data;
+  for (uint8_t i = 0; i < 8; ++i) {
+    if (crc & 1)
+      crc = (crc >> 1) ^ 0xEDB88320;
+    else
+      crc = (crc >> 1);
+  }
+  return crc;
+}
+
 template <typename T, T Update(T, uint8_t), T Initial>
 class Crc {
   public:
@@ -122,3 +135,4 @@ using Crc8Ccitt = Crc<uint8_t, _crc8_ccitt_update, 0xff>;
 using Crc16Ccitt = Crc<uint16_t, _crc_ccitt_update, 0xffff>;
 // Called CRC16-IBM (or CRC16-ANSI or just CRC16) by wikipedia, used by ModBus
 using Crc16Ibm = Crc<uint16_t, _crc16_update, 0xffff>;
+using Crc32 = Crc<uint32_t, _crc32_update, 0xffffffff>;
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2017-2025 3devo (http://www.3devo.eu)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BUFFERS_H_
+#define BUFFERS_H_
+
+#include <stdint.h>
+#include "Config.h"
+
+// Note that we must buffer a full erase page size (not smaller), since
+// we must know at the start of an erase page whether any byte in the
+// entire page is changed to decide whether or not to erase. When
+// USE_PAGE_BUFFER is set, the last write page of each erase page is
+// not kept here, but loaded into the hardware page buffer directly.
+#if defined(USE_PAGE_BUFFER)
+	#if FLASH_ERASE_SIZE <= FLASH_WRITE_SIZE
+	#error "USE_PAGE_BUFFER needs multiple write pages per erase page"
+	#endif
+	const uint16_t BUFFERED_SIZE = FLASH_ERASE_SIZE - FLASH_WRITE_SIZE;
+#else
+	const uint16_t BUFFERED_SIZE = FLASH_ERASE_SIZE;
+#endif
+
+// All big buffers are declared together, rather than in the modules
+// that use them, so their combined size can be checked against the
+// available RAM at compile time. Each buffer has its own space, since
+// the bus buffer and the page buffer are both in use between packets.
+struct Buffers {
+	// Packets received from and sent to the bus
+	uint8_t bus[MAX_PACKET_LENGTH];
+	// Data of the erase page currently being written
+	uint8_t write[BUFFERED_SIZE];
+	#if defined(HAVE_BATCH)
+	// Each sub-command of a BATCH is copied here and run with its
+	// reply offset by two bytes, just like with the RS485 framing
+	uint8_t batch[MAX_PACKET_LENGTH];
+	#endif
+};
+
+extern Buffers buffers;
+
+static_assert(sizeof(Buffers) + MIN_FREE_RAM <= RAM_SIZE, "Buffers leave too little RAM, reduce MAX_PACKET_LENGTH");
+
+#endif /* BUFFERS_H_ */
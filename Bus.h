@@ -23,11 +23,73 @@
 
 static_assert(MAX_PACKET_LENGTH >= 32, "Protocol requires at least 32-byte packets");
 
+#if defined(USE_RS485)
+const uint32_t RS485_BAUD_RATE = 1000000;
+#endif
+
 void BusUpdate();
-void BusInit();
+// When configured is true, the bus hardware was already set up
+// identically (by the application, before jumping into the
+// bootloader), so it does not need to be configured again.
+void BusInit(bool configured = false);
 void BusDeinit();
 void BusSetDeviceAddress(uint8_t address);
 void BusResetDeviceAddress();
 
 int BusCallback(uint8_t address, uint8_t *buffer, uint8_t len, uint8_t maxLen);
+
+#if defined(USE_RS485)
+// Called from BusCallback() to delay the reply it returns until the
+// given time slot, where each slot fits a reply of slotLength bytes
+// (including address and CRC) plus an inter-frame gap. Slots are
+// counted from the end of the request, so time spent processing it is
+// subtracted, and the reply is dropped when it no longer fits its slot.
+// Only applies to the next reply.
+void BusDelayReply(uint8_t slot, uint8_t slotLength);
+#endif
+
+#if defined(HAVE_STREAMING) && defined(USE_I2C)
+// Streaming transfers (see STREAM_FLASH in PROTOCOL.md). At the start
+// of each transaction, the bus implementation calls BusStreamBegin() to
+// check whether it is part of a stream. If so, the data of a write
+// transaction is passed to BusStreamWrite() each time the buffer is
+// full, instead of being handled as a single packet. For a read
+// transaction, any reply still in the buffer is sent first, and then
+// the buffer is refilled using BusStreamRead() each time it runs
+// empty. Both are called while the master is clock-stretched, so they
+// can take a while (e.g. to erase flash).
+//
+// At the end of a streamed transaction, BusStreamEnd() is called
+// instead of BusCallback(), with the bytes received since the last
+// BusStreamWrite() call (if any). It returns the length of the reply
+// to send, just like BusCallback().
+bool BusStreamBegin(uint8_t address, bool read);
+void BusStreamWrite(uint8_t *buffer, uint8_t len);
+uint8_t BusStreamRead(uint8_t *buffer, uint8_t maxLen);
+int BusStreamEnd(uint8_t *buffer, uint8_t len, uint8_t maxLen);
+#endif
+
+#if defined(HAVE_BUS_STATS)
+// Counters for bus traffic and errors, updated by the bus
+// implementation and BaseProtocol. Counters that do not apply to a bus
+// stay 0. The order matches the GET_BUS_STATS reply.
+struct BusStats {
+	uint32_t framesSeen;
+	uint32_t framesAddressed;
+	uint32_t bytesReceived;
+	uint32_t bytesSent;
+	uint32_t parityErrors;
+	uint32_t framingErrors;
+	uint32_t overrunErrors;
+	uint32_t rxOverflows;
+	uint32_t crcErrors;
+	uint32_t repliesSuppressed;
+};
+
+extern BusStats busStats;
+
+#define BUS_STATS_INC(counter) (++busStats.counter)
+#else
+#define BUS_STATS_INC(counter) do { } while (0)
+#endif // defined(HAVE_BUS_STATS)
 #endif /* BUS_H_ */
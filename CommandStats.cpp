@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2017-2025 3devo (http://www.3devo.eu)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "CommandStats.h"
+
+#if defined(HAVE_COMMAND_STATS)
+
+// Upper limit (exclusive) of each bucket in μs, the last bucket has no
+// limit. The last limit is the maximum reply time for RS485.
+static const uint32_t bucketLimits[CommandStats::NUM_BUCKETS - 1] = {
+	100, 300, 1000, 3000, 10000, 30000, 80000,
+};
+
+static CommandStats::Entry entries[CommandStats::NUM_COMMANDS];
+
+// Entry is packed, so this takes and returns the counter by value
+// rather than through a (possibly unaligned) pointer
+static uint16_t increment(uint16_t counter) {
+	return counter == UINT16_MAX ? counter : counter + 1;
+}
+
+void CommandStats::record(uint8_t cmd, uint32_t duration) {
+	if (cmd >= NUM_COMMANDS)
+		return;
+
+	Entry& entry = entries[cmd];
+	if (!entry.count || duration < entry.min)
+		entry.min = duration;
+	if (duration > entry.max)
+		entry.max = duration;
+	entry.count = increment(entry.count);
+
+	uint8_t bucket = 0;
+	while (bucket < NUM_BUCKETS - 1 && duration >= bucketLimits[bucket])
+		++bucket;
+	entry.buckets[bucket] = increment(entry.buckets[bucket]);
+}
+
+const CommandStats::Entry *CommandStats::get(uint8_t cmd) {
+	if (cmd >= NUM_COMMANDS)
+		return nullptr;
+	return &entries[cmd];
+}
+
+void CommandStats::reset(uint8_t cmd) {
+	if (cmd < NUM_COMMANDS)
+		entries[cmd] = Entry();
+}
+
+#endif // defined(HAVE_COMMAND_STATS)
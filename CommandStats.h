@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2017-2025 3devo (http://www.3devo.eu)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef COMMANDSTATS_H_
+#define COMMANDSTATS_H_
+
+#include <stdint.h>
+#include "Config.h"
+
+#if defined(HAVE_COMMAND_STATS)
+
+// Keeps track of how long processing each command takes, to see how
+// close commands get to the maximum reply time allowed by the protocol.
+class CommandStats {
+public:
+	// Commands with a lower ID than this are tracked
+	static const uint8_t NUM_COMMANDS = 0x20;
+	static const uint8_t NUM_BUCKETS = 8;
+
+	struct Entry {
+		// These saturate instead of overflowing
+		uint16_t count;
+		uint16_t buckets[NUM_BUCKETS];
+		// In μs, only valid when count is non-zero
+		uint32_t min;
+		uint32_t max;
+	};
+
+	// Records the processing time of a single command
+	static void record(uint8_t cmd, uint32_t duration);
+
+	// Returns the statistics for the given command, or nullptr if it
+	// is not tracked.
+	static const Entry *get(uint8_t cmd);
+
+	static void reset(uint8_t cmd);
+};
+
+#endif // defined(HAVE_COMMAND_STATS)
+
+#endif /* COMMANDSTATS_H_ */
@@ -27,25 +27,63 @@
 
 	const uint8_t INFO_HW_TYPE = 1;
 	const uint8_t DISPLAY_CONTROLLER_TYPE = 1;
-        const uint16_t MAX_PACKET_LENGTH = 32;
+	// Can be raised with make PACKET_LENGTH=n, see README
+	#if defined(PACKET_LENGTH)
+	const uint16_t MAX_PACKET_LENGTH = PACKET_LENGTH;
+	#else
+	const uint16_t MAX_PACKET_LENGTH = 32;
+	#endif
+	// RAM that must be left for the stack and other variables
+	// after allocating the buffers (see Buffers.h). This is a
+	// conservative estimate, not a measured stack high-water mark.
+	const uint16_t RAM_SIZE = 512;
+	const uint16_t MIN_FREE_RAM = 256;
+	#if defined(MEASURE_RAM_USAGE)
+	#define HAVE_RAM_USAGE
+	#endif
         const uint32_t BOARD_INFO_SIGNATURE = 0x489D6AB6;
 	#define HAVE_DISPLAY
 	#define NEED_TRAMPOLINE
+	#define USE_PAGE_BUFFER
 #elif defined(BOARD_TYPE_gphopper)
 	const uint8_t INFO_HW_TYPE = 2;
         const uint16_t MAX_PACKET_LENGTH = 255;
+	const uint16_t RAM_SIZE = 8192;
+	const uint16_t MIN_FREE_RAM = 4096;
         constexpr const Pin CHILDREN_SELECT_PINS[] = {
             {RCC_GPIOB, GPIOB, GPIO8},
         };
         const Pin CHILD_SELECT_PIN = {RCC_GPIOB, GPIOB, GPIO9};
         const uint32_t BOARD_INFO_SIGNATURE = 0xFAABC3C2;
 	#define USE_CHILD_SELECT
+	#define HAVE_EXTENDED_ADDRESSING
+	#define VERIFY_FLASH
+	#define HAVE_PAGE_DIGESTS
+	#if defined(HAVE_IMAGE_MANIFEST)
+	// Progress is stored in the manifest page
+	#define HAVE_RESUME_FLASH
+	#endif
+	#define HAVE_HANDOFF
+	#define HAVE_BOOT_PROFILE
+	#define HAVE_COMMAND_STATS
+	#define HAVE_BUS_STATS
+	#define HAVE_RAM_USAGE
+	#define HAVE_BATCH
+	#define HAVE_DEVICE_DESCRIPTOR
+	#define HAVE_CAPABILITIES
+	#define HAVE_SLOTTED_QUERY
+	#define HAVE_SERIAL_SEARCH
+	#define HAVE_STREAMING
 #else
 	#error "No board type defined"
 #endif
 
 const uint8_t BOARD_INFO_MAJOR_VERSION = 2;
 
+#if defined(HAVE_BOOT_PROFILE) || defined(HAVE_COMMAND_STATS) || defined(ENABLE_TRACE) || (defined(HAVE_SLOTTED_QUERY) && defined(USE_RS485))
+	#define NEED_TIMER
+#endif
+
 #if defined(USE_CHILD_SELECT)
 const uint8_t NUM_CHILDREN = sizeof(CHILDREN_SELECT_PINS) / sizeof(*CHILDREN_SELECT_PINS);
 #endif
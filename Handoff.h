@@ -0,0 +1,186 @@
+/*
+ * Copyright (C) 2025 3devo (http://www.3devo.eu)
+ *
+ * Permission is hereby granted, free of charge, to anyone obtaining a
+ * copy of this document to do whatever they want with them without any
+ * restriction, including, but not limited to, copying, modification and
+ * redistribution.
+ *
+ * NO WARRANTY OF ANY KIND IS PROVIDED.
+ */
+
+#ifndef HANDOFF_H_
+#define HANDOFF_H_
+
+// This header defines the handoff block that the bootloader leaves for
+// the application when it is started using START_APPLICATION. This
+// allows the application to continue using the bus address assigned by
+// the master and board info already parsed by the bootloader, without
+// another round of enumeration.
+//
+// The same block is used in the other direction by enterBootloader(),
+// which allows the application to start the bootloader directly
+// (without a reset), keeping its bus address and clock setup.
+//
+// This header is intended to be copied into application code, so it
+// has no dependencies on the rest of the bootloader.
+//
+// On STM32G0, the block is stored in the TAMP backup registers (all
+// five of them), which survive a jump to the application (and resets),
+// but not a loss of power. It is only written by the bootloader right
+// before starting the application, and applications should use
+// readBootloaderHandoff() and clearBootloaderHandoff() once at startup,
+// so the block is not used again after e.g. a later watchdog reset.
+
+#include <stdint.h>
+#include <string.h>
+
+struct BootloaderHandoff {
+	// Magic values for each direction
+	static const uint16_t TO_APPLICATION = 0x4842; // "BH"
+	static const uint16_t TO_BOOTLOADER  = 0x4542; // "BE"
+	static const uint8_t VERSION = 1;
+
+	struct Flags {
+		// Only for TO_BOOTLOADER: the bus hardware is already
+		// set up exactly like the bootloader would, so it does
+		// not need to be reconfigured
+		static const uint8_t BUS_CONFIGURED = 0x01;
+	};
+
+	uint16_t magic;
+	uint8_t version;
+	// Address set by the master using SET_ADDRESS, or 0 when no
+	// address was set.
+	uint8_t address;
+	// These are copied from the board info
+	uint8_t current_board_version;
+	uint8_t compatible_board_version;
+	uint8_t manufacturer_id;
+	uint8_t flags;
+	uint16_t board_number;
+	uint32_t component_variations;
+	// Bus line settings: for RS485 the baudrate (always with 8E1
+	// framing), 0 for I²C (where the master determines the speed)
+	uint32_t baud_rate;
+	// CRC16 (as used by ModBus) over all previous bytes
+	uint16_t crc;
+} __attribute__((packed));
+
+static_assert(sizeof(BootloaderHandoff) == 20, "Handoff block must fit in backup registers");
+
+inline uint16_t bootloaderHandoffCrc(const BootloaderHandoff *handoff) {
+	const uint8_t *ptr = (const uint8_t*)handoff;
+	uint16_t crc = 0xffff;
+	for (uint8_t i = 0; i < sizeof(*handoff) - sizeof(handoff->crc); ++i) {
+		crc ^= ptr[i];
+		for (uint8_t bit = 0; bit < 8; ++bit)
+			crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : (crc >> 1);
+	}
+	return crc;
+}
+
+#if defined(STM32G0) || defined(STM32G0xx)
+namespace BootloaderHandoffRegs {
+	// Raw register addresses, so this works regardless of the
+	// peripheral library used
+	static volatile uint32_t * const RCC_APBENR1 = (volatile uint32_t*)0x4002103c;
+	static const uint32_t RCC_APBENR1_RTCAPBEN = (1 << 10);
+	static const uint32_t RCC_APBENR1_PWREN = (1 << 28);
+	static volatile uint32_t * const PWR_CR1 = (volatile uint32_t*)0x40007000;
+	static const uint32_t PWR_CR1_DBP = (1 << 8);
+	static volatile uint32_t * const TAMP_BKPR = (volatile uint32_t*)0x4000b100;
+	static volatile uint32_t * const NVIC_ICER = (volatile uint32_t*)0xe000e180;
+	static volatile uint32_t * const NVIC_ICPR = (volatile uint32_t*)0xe000e280;
+	static volatile uint32_t * const SYST_CSR = (volatile uint32_t*)0xe000e010;
+	static volatile uint32_t * const SCB_VTOR = (volatile uint32_t*)0xe000ed08;
+	static const uint32_t FLASH_START = 0x08000000;
+
+	// Enables access to the backup registers. Returns the previous
+	// state to pass to end()
+	inline uint32_t begin() {
+		uint32_t apbenr1 = *RCC_APBENR1;
+		*RCC_APBENR1 = apbenr1 | RCC_APBENR1_RTCAPBEN | RCC_APBENR1_PWREN;
+		*PWR_CR1 |= PWR_CR1_DBP;
+		return apbenr1;
+	}
+
+	inline void end(uint32_t apbenr1) {
+		*PWR_CR1 &= ~PWR_CR1_DBP;
+		*RCC_APBENR1 = apbenr1;
+	}
+}
+
+inline void writeBootloaderHandoff(BootloaderHandoff *handoff, uint16_t magic) {
+	handoff->magic = magic;
+	handoff->version = BootloaderHandoff::VERSION;
+	handoff->crc = bootloaderHandoffCrc(handoff);
+
+	uint32_t words[sizeof(*handoff) / 4];
+	memcpy(words, handoff, sizeof(words));
+	uint32_t state = BootloaderHandoffRegs::begin();
+	for (uint8_t i = 0; i < sizeof(words) / 4; ++i)
+		BootloaderHandoffRegs::TAMP_BKPR[i] = words[i];
+	BootloaderHandoffRegs::end(state);
+}
+
+// Reads the handoff block. Returns false when there is no valid block
+// with the given magic.
+inline bool readBootloaderHandoff(BootloaderHandoff *handoff, uint16_t magic) {
+	uint32_t words[sizeof(*handoff) / 4];
+	uint32_t state = BootloaderHandoffRegs::begin();
+	for (uint8_t i = 0; i < sizeof(words) / 4; ++i)
+		words[i] = BootloaderHandoffRegs::TAMP_BKPR[i];
+	BootloaderHandoffRegs::end(state);
+	memcpy(handoff, words, sizeof(words));
+
+	return handoff->magic == magic
+	    && handoff->version == BootloaderHandoff::VERSION
+	    && handoff->crc == bootloaderHandoffCrc(handoff);
+}
+
+inline void clearBootloaderHandoff() {
+	uint32_t state = BootloaderHandoffRegs::begin();
+	for (uint8_t i = 0; i < sizeof(BootloaderHandoff) / 4; ++i)
+		BootloaderHandoffRegs::TAMP_BKPR[i] = 0;
+	BootloaderHandoffRegs::end(state);
+}
+
+// Starts the bootloader directly from the application, without a
+// reset. The bootloader continues to use the given bus address (0 for
+// none) and the current clock setup (as long as the AHB and APB
+// prescalers are left at their reset value of 1). Pass
+// Flags::BUS_CONFIGURED in flags only when the bus hardware is set up
+// exactly like the bootloader would (e.g. for RS485: USART1 on PA9/PA10
+// with DE on PA12, same baudrate, 8E1, receiver timeout and no
+// interrupts, DMA or FIFO enabled), otherwise it is reset and
+// reconfigured. It is also reconfigured when the bootloader was built
+// with CLOCK_BOOST and switches to a faster clock (which it does
+// unless the application runs from HSE).
+//
+// The entry point is the reset vector of the bootloader at the start of
+// flash. Before jumping there, SysTick is stopped and all interrupts are
+// disabled and cleared in the NVIC, since the bootloader does not expect
+// them. PRIMASK is cleared again afterwards, like after a reset, so the
+// bootloader can use its own interrupts (with BUS_USE_INTERRUPTS).
+inline void __attribute__((noreturn)) enterBootloader(uint8_t address, uint8_t flags) {
+	BootloaderHandoff handoff;
+	memset(&handoff, 0, sizeof(handoff));
+	handoff.address = address;
+	handoff.flags = flags;
+	writeBootloaderHandoff(&handoff, BootloaderHandoff::TO_BOOTLOADER);
+
+	__asm__ volatile ("cpsid i");
+	*BootloaderHandoffRegs::SYST_CSR = 0;
+	*BootloaderHandoffRegs::NVIC_ICER = 0xffffffff;
+	*BootloaderHandoffRegs::NVIC_ICPR = 0xffffffff;
+	*BootloaderHandoffRegs::SCB_VTOR = BootloaderHandoffRegs::FLASH_START;
+	__asm__ volatile ("cpsie i");
+
+	const uint32_t *bootloader = (const uint32_t*)BootloaderHandoffRegs::FLASH_START;
+	__asm__ volatile ("msr msp, %0; bx %1;" : : "r"(bootloader[0]), "r"(bootloader[1]));
+	__builtin_unreachable();
+}
+#endif // defined(STM32G0) || defined(STM32G0xx)
+
+#endif /* HANDOFF_H_ */
@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2017-2025 3devo (http://www.3devo.eu)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <string.h>
+#include "Metadata.h"
+#include "SelfProgram.h"
+
+#if defined(HAVE_IMAGE_MANIFEST)
+
+#if defined(NEED_TRAMPOLINE)
+#error "HAVE_IMAGE_MANIFEST not supported with NEED_TRAMPOLINE"
+#endif
+
+#if !defined(VERIFY_FLASH)
+#error "HAVE_IMAGE_MANIFEST needs VERIFY_FLASH for calculating the image CRC"
+#endif
+
+static_assert(sizeof(MetadataRecord) % 8 == 0, "Metadata records must be a multiple of 8 bytes");
+
+static const uint16_t NUM_SLOTS = FLASH_ERASE_SIZE / sizeof(MetadataRecord);
+
+static void readSlot(uint16_t slot, MetadataRecord *record) {
+	SelfProgram::readFlash(SelfProgram::metadataAddress + slot * sizeof(*record), (uint8_t*)record, sizeof(*record));
+}
+
+static bool isErased(const MetadataRecord *record) {
+	const uint8_t *ptr = (const uint8_t*)record;
+	for (uint8_t i = 0; i < sizeof(*record); ++i) {
+		if (ptr[i] != 0xff)
+			return false;
+	}
+	return true;
+}
+
+// Finds the first free slot (NUM_SLOTS if the page is full) and reads
+// the last valid record into record (if any, otherwise its type is
+// left erased).
+static uint16_t scan(MetadataRecord *record) {
+	MetadataRecord current;
+	record->type = 0xffffffff;
+	uint16_t slot;
+	for (slot = 0; slot < NUM_SLOTS; ++slot) {
+		readSlot(slot, &current);
+		if (isErased(&current))
+			break;
+		// Records are written back to front, so if the type is
+		// missing, writing was interrupted and this record is
+		// skipped.
+		if (current.type != 0xffffffff)
+			*record = current;
+	}
+	return slot;
+}
+
+bool Metadata::last(MetadataRecord *record) {
+	scan(record);
+	return record->type != 0xffffffff;
+}
+
+uint8_t Metadata::append(const MetadataRecord *record) {
+	MetadataRecord last;
+	uint16_t slot = scan(&last);
+	if (slot == NUM_SLOTS) {
+		uint8_t err = SelfProgram::eraseMetadata();
+		if (err)
+			return err;
+		slot = 0;
+	}
+	return SelfProgram::writeMetadata(slot * sizeof(*record), (const uint8_t*)record, sizeof(*record));
+}
+
+bool Metadata::readManifest(MetadataRecord *record) {
+	return last(record) && record->type == Types::MANIFEST;
+}
+
+uint8_t Metadata::writeManifest(uint32_t length, uint32_t crc, const uint8_t *tag) {
+	MetadataRecord record;
+	if (readManifest(&record) && record.length == length && record.crc == crc && !memcmp(record.tag, tag, sizeof(record.tag)))
+		return 0;
+
+	memset(&record, 0xff, sizeof(record));
+	record.type = Types::MANIFEST;
+	record.length = length;
+	record.crc = crc;
+	memcpy(record.tag, tag, sizeof(record.tag));
+	return append(&record);
+}
+
+uint8_t Metadata::writeProgress(uint32_t length, const uint8_t *tag) {
+	MetadataRecord record;
+	memset(&record, 0xff, sizeof(record));
+	record.type = Types::PROGRESS;
+	record.length = length;
+	memcpy(record.tag, tag, sizeof(record.tag));
+	return append(&record);
+}
+
+uint8_t Metadata::invalidate() {
+	MetadataRecord record;
+	if (!last(&record) || (record.type != Types::MANIFEST && record.type != Types::PROGRESS))
+		return 0;
+
+	memset(&record, 0xff, sizeof(record));
+	record.type = Types::INVALIDATED;
+	return append(&record);
+}
+
+#endif // defined(HAVE_IMAGE_MANIFEST)
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2017-2025 3devo (http://www.3devo.eu)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef METADATA_H_
+#define METADATA_H_
+
+#include <stdint.h>
+#include "Config.h"
+
+#if defined(HAVE_IMAGE_MANIFEST)
+
+constexpr const uint8_t MANIFEST_TAG_SIZE = 8;
+
+// A record in the metadata page. Records are a multiple of 8 bytes, so
+// each can be written separately on STM32.
+struct MetadataRecord {
+	uint32_t type;
+	uint32_t length;
+	uint32_t crc;
+	uint32_t rfu;
+	uint8_t tag[MANIFEST_TAG_SIZE];
+};
+
+// The metadata page is used as an append-only log: records are written
+// one after another and the last record written determines the
+// current state. This way, updating the metadata normally does not
+// need an erase. When the page is full, it is erased and writing
+// starts over at the start of the page.
+class Metadata {
+public:
+	struct Types {
+		// Indicates an image with the given length, crc and
+		// tag was completely written
+		static const uint32_t MANIFEST    = 0x314e414d; // "MAN1"
+		// Indicates the image was changed since the last
+		// manifest was written
+		static const uint32_t INVALIDATED = 0x31564e49; // "INV1"
+		// Indicates an upload of the image with the given tag
+		// is in progress, and the given length was written
+		// completely
+		static const uint32_t PROGRESS    = 0x31475250; // "PRG1"
+	};
+
+	// Reads the last record written. Returns false if there is
+	// none.
+	static bool last(MetadataRecord *record);
+
+	static uint8_t append(const MetadataRecord *record);
+
+	// Reads the manifest for the current image. Returns false if
+	// there is no (valid) manifest.
+	static bool readManifest(MetadataRecord *record);
+
+	// Stores a manifest, unless an identical manifest is already
+	// current.
+	static uint8_t writeManifest(uint32_t length, uint32_t crc, const uint8_t *tag);
+
+	// Stores the progress of an upload
+	static uint8_t writeProgress(uint32_t length, const uint8_t *tag);
+
+	// Marks the current manifest or upload progress as no longer
+	// valid, if there is one. Must be called before the image is
+	// changed outside of an upload session.
+	static uint8_t invalidate();
+};
+
+#endif // defined(HAVE_IMAGE_MANIFEST)
+
+#endif /* METADATA_H_ */
@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2017-2025 3devo (http://www.3devo.eu)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "PageDigests.h"
+
+#if defined(HAVE_PAGE_DIGESTS)
+
+#if !defined(VERIFY_FLASH)
+#error "HAVE_PAGE_DIGESTS needs VERIFY_FLASH for calculating CRCs"
+#endif
+
+// With BUS_USE_INTERRUPTS, invalidate() and get() run from the bus
+// interrupt, so update() masks interrupts while it changes the shared
+// state below.
+#if defined(BUS_USE_INTERRUPTS)
+#if defined(STM32)
+#include <libopencm3/cm3/cortex.h>
+#else
+#error "HAVE_PAGE_DIGESTS with BUS_USE_INTERRUPTS only supported on STM32"
+#endif
+#endif
+
+static_assert(SelfProgram::applicationSize % FLASH_ERASE_SIZE == 0, "Application size must be a multiple of FLASH_ERASE_SIZE");
+
+// Number of bytes processed by a single update() call. This is kept
+// small, so the bus is still serviced in time (at 1Mbaud, a byte
+// arrives every 11μs and there is no receive FIFO).
+static const uint16_t STEP_SIZE = 16;
+static_assert(FLASH_ERASE_SIZE % STEP_SIZE == 0, "FLASH_ERASE_SIZE must be a multiple of STEP_SIZE");
+
+static uint32_t digests[PageDigests::NUM_PAGES];
+static uint8_t valid[(PageDigests::NUM_PAGES + 7) / 8];
+
+// The digest currently being calculated by update()
+static uint16_t currentPage = 0;
+static uint16_t currentOffset = 0;
+static uint32_t currentCrc;
+
+static bool isValid(uint16_t page) {
+	return valid[page / 8] & (1 << (page % 8));
+}
+
+static void store(uint16_t page, uint32_t digest) {
+	digests[page] = digest;
+	valid[page / 8] |= (1 << (page % 8));
+}
+
+static bool step() {
+	if (currentOffset == 0) {
+		// Find the next page to calculate, wrapping around to
+		// pick up pages that were invalidated in the meanwhile.
+		uint16_t page = currentPage;
+		while (isValid(page)) {
+			if (++page == PageDigests::NUM_PAGES)
+				page = 0;
+			if (page == currentPage)
+				return false; // All done
+		}
+		currentPage = page;
+		currentCrc = SelfProgram::CRC32_INITIAL;
+	}
+
+	flash_addr_t address = FLASH_APP_OFFSET + (flash_addr_t)currentPage * FLASH_ERASE_SIZE + currentOffset;
+	currentCrc = SelfProgram::crc32Update(currentCrc, address, STEP_SIZE);
+	currentOffset += STEP_SIZE;
+	if (currentOffset == FLASH_ERASE_SIZE) {
+		store(currentPage, SelfProgram::crc32Finish(currentCrc));
+		currentOffset = 0;
+	}
+	return true;
+}
+
+bool PageDigests::update() {
+	#if defined(BUS_USE_INTERRUPTS)
+	// A single step blocks the bus interrupt no longer than it blocks
+	// polling without interrupts
+	cm_disable_interrupts();
+	bool more = step();
+	cm_enable_interrupts();
+	return more;
+	#else
+	return step();
+	#endif
+}
+
+void PageDigests::invalidate(uint16_t page) {
+	valid[page / 8] &= ~(1 << (page % 8));
+	// Restart when the page is changed halfway
+	if (page == currentPage)
+		currentOffset = 0;
+}
+
+uint32_t PageDigests::get(uint16_t page) {
+	if (!isValid(page)) {
+		store(page, SelfProgram::crc32(FLASH_APP_OFFSET + (flash_addr_t)page * FLASH_ERASE_SIZE, FLASH_ERASE_SIZE));
+		if (page == currentPage)
+			currentOffset = 0;
+	}
+	return digests[page];
+}
+
+#endif // defined(HAVE_PAGE_DIGESTS)
@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2017-2025 3devo (http://www.3devo.eu)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef PAGEDIGESTS_H_
+#define PAGEDIGESTS_H_
+
+#include <stdint.h>
+#include "Config.h"
+#include "SelfProgram.h"
+
+#if defined(HAVE_PAGE_DIGESTS)
+
+// Keeps a CRC32 digest of each erase page of the application area in
+// RAM. Digests are calculated a little bit at a time while the
+// bootloader is idle, so they are usually available immediately when
+// the master asks for them.
+class PageDigests {
+public:
+	static const uint16_t NUM_PAGES = SelfProgram::applicationSize / FLASH_ERASE_SIZE;
+
+	// Does a small part of the work of calculating the next missing
+	// digest. Should be called repeatedly while idle. Returns false
+	// when all digests are up to date.
+	static bool update();
+
+	// Marks the digest of the given page as outdated. Must be called
+	// whenever the page is changed.
+	static void invalidate(uint16_t page);
+
+	// Returns the digest of the given page, calculating it first
+	// if needed.
+	static uint32_t get(uint16_t page);
+};
+
+#endif // defined(HAVE_PAGE_DIGESTS)
+
+#endif /* PAGEDIGESTS_H_ */
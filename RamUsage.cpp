@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2017-2025 3devo (http://www.3devo.eu)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "RamUsage.h"
+
+#if defined(HAVE_RAM_USAGE)
+
+#if defined(__AVR__)
+#include <avr/io.h>
+// Provided by the default avr-libc linker script
+extern uint8_t __data_start;
+extern uint8_t _end;
+#define RAM_START (&__data_start)
+#define STATIC_END (&_end)
+#define RAM_END ((uint8_t*)RAMEND + 1)
+#elif defined(STM32)
+// Provided by the libopencm3 linker script
+extern uint8_t _data;
+extern uint8_t _ebss;
+extern uint8_t _stack;
+#define RAM_START (&_data)
+#define STATIC_END (&_ebss)
+#define RAM_END (&_stack)
+#endif
+
+static const uint8_t PATTERN = 0xc5;
+// Keep away from the stack frame of paint() itself
+static const uint8_t MARGIN = 32;
+
+void RamUsage::paint() {
+	uint8_t *end = (uint8_t*)__builtin_frame_address(0) - MARGIN;
+	for (uint8_t *p = STATIC_END; p < end; ++p)
+		*p = PATTERN;
+}
+
+uint16_t RamUsage::total() {
+	return RAM_END - RAM_START;
+}
+
+uint16_t RamUsage::statics() {
+	return STATIC_END - RAM_START;
+}
+
+uint16_t RamUsage::maxStack() {
+	const uint8_t *p = STATIC_END;
+	while (p < RAM_END && *p == PATTERN)
+		++p;
+	return RAM_END - p;
+}
+
+#endif // defined(HAVE_RAM_USAGE)
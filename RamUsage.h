@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2017-2025 3devo (http://www.3devo.eu)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef RAMUSAGE_H_
+#define RAMUSAGE_H_
+
+#include <stdint.h>
+#include "Config.h"
+
+#if defined(HAVE_RAM_USAGE)
+
+// Measures how much RAM is actually used, by filling all unused RAM
+// with a known pattern at startup ("stack painting") and checking how
+// much of it was overwritten by the stack later.
+class RamUsage {
+public:
+	// Fills the RAM between the static variables and the stack with
+	// a pattern. Should be called at the very start of main().
+	static void paint();
+
+	// Total RAM size
+	static uint16_t total();
+	// RAM used by static variables (.data and .bss)
+	static uint16_t statics();
+	// Maximum stack size used since paint() was called
+	static uint16_t maxStack();
+};
+
+#endif // defined(HAVE_RAM_USAGE)
+
+#endif /* RAMUSAGE_H_ */
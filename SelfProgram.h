@@ -21,13 +21,57 @@
 #include <stdint.h>
 #include "Config.h"
 
+// Flash addresses are 16-bit by default, but can be 32-bit for devices
+// with more than 64k of flash (at the expense of some extra code size)
+#if defined(HAVE_EXTENDED_ADDRESSING)
+typedef uint32_t flash_addr_t;
+#else
+typedef uint16_t flash_addr_t;
+#endif
+
 class SelfProgram {
 public:
-	static void readFlash(uint16_t address, uint8_t *data, uint16_t len);
+	static void readFlash(flash_addr_t address, uint8_t *data, uint16_t len);
+
+	static uint8_t readByte(flash_addr_t address);
+
+	// Erases the erase page starting at the given address. On
+	// attiny, data must point to the (first bytes of the) data to
+	// be written to the page, to allow relocating the reset vector.
+	static uint8_t erasePage(flash_addr_t address, uint8_t *data);
+
+	// Programs a single (already erased) write page. The first
+	// headLen bytes are taken from head, the remaining bytes (up to
+	// len) from tail. This allows assembling a page from buffered
+	// bytes and bytes still in the bus buffer without copying.
+	static uint8_t writePage(flash_addr_t address, const uint8_t *head, uint16_t headLen, const uint8_t *tail, uint16_t len);
+
+	#if defined(USE_PAGE_BUFFER)
+	// Loads a byte directly into the hardware page buffer. Bytes
+	// must be loaded in order, starting at a write page boundary.
+	static void fillPageBuffer(flash_addr_t address, uint8_t data);
 
-	static uint8_t readByte(uint16_t address);
+	// Programs the page buffer loaded with fillPageBuffer into the
+	// (already erased) write page at address.
+	static uint8_t writePageBuffer(flash_addr_t address, uint16_t len);
 
-	static uint8_t writePage(uint16_t address, uint8_t *data, uint16_t len);
+	static void clearPageBuffer();
+	#endif // defined(USE_PAGE_BUFFER)
+
+	#if defined(VERIFY_FLASH)
+	// Returns the CRC32 (as used by zlib, ethernet, etc.) of the
+	// given flash area.
+	static uint32_t crc32(flash_addr_t address, flash_addr_t len) {
+		return crc32Finish(crc32Update(CRC32_INITIAL, address, len));
+	}
+
+	// Calculates a CRC32 in parts: start with CRC32_INITIAL, pass
+	// the result of each crc32Update call into the next one for
+	// consecutive areas and finally pass it to crc32Finish.
+	static const uint32_t CRC32_INITIAL = 0xffffffff;
+	static uint32_t crc32Update(uint32_t crc, flash_addr_t address, flash_addr_t len);
+	static uint32_t crc32Finish(uint32_t crc);
+	#endif // defined(VERIFY_FLASH)
 
 	#if defined(NEED_TRAMPOLINE)
 	static void writeTrampoline(uint16_t instruction);
@@ -39,8 +83,20 @@ public:
 	// Use a reference to make this an alias to trampolineStart for
 	// readability
 	static constexpr const uint16_t& applicationSize = trampolineStart;
+	#elif defined(HAVE_IMAGE_MANIFEST)
+	// The last erase page of the application area is reserved for
+	// metadata (see Metadata.h)
+	static constexpr const flash_addr_t applicationSize = APPLICATION_SIZE - FLASH_ERASE_SIZE;
+	static constexpr const flash_addr_t metadataAddress = FLASH_APP_OFFSET + applicationSize;
+
+	static uint8_t eraseMetadata();
+
+	// Writes data to the (erased part of the) metadata page. Offset
+	// and len must be a multiple of 8. Data is written back to
+	// front, so if the first bytes are written, the rest is too.
+	static uint8_t writeMetadata(uint16_t offset, const uint8_t *data, uint16_t len);
 	#else
-	static constexpr const uint16_t applicationSize = APPLICATION_SIZE;
+	static constexpr const flash_addr_t applicationSize = APPLICATION_SIZE;
 	#endif // defined(NEED_TRAMPOLINE)
 
 	static uint8_t eraseCount;
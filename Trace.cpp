@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2017-2025 3devo (http://www.3devo.eu)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "Trace.h"
+#include "bootloader.h"
+
+#if defined(ENABLE_TRACE)
+
+// Implemented by uart.cpp for each arch
+extern bool uart_try_write(uint8_t byte);
+
+static const uint8_t SYNC = 0xa5;
+static const uint8_t RECORD_BYTES = 8;
+// Must be a power of two, so the index calculations are cheap
+static const uint8_t RING_SIZE = 32;
+
+struct Record {
+	uint8_t event;
+	uint8_t a;
+	uint8_t b;
+	uint32_t time;
+};
+
+// record() only changes head and flush() only changes tail, so records
+// can be made from an interrupt handler as well (but not from both
+// interrupts and the main loop).
+static Record ring[RING_SIZE];
+static volatile uint8_t head;
+static volatile uint8_t tail;
+static uint16_t dropped;
+// Position of the next byte to send within the record at tail
+static uint8_t sendPos;
+
+static bool push(uint8_t event, uint8_t a, uint8_t b) {
+	uint8_t next = (head + 1) % RING_SIZE;
+	if (next == tail)
+		return false;
+
+	Record& r = ring[head];
+	r.event = event;
+	r.a = a;
+	r.b = b;
+	r.time = TimerMicros();
+	head = next;
+	return true;
+}
+
+void Trace::record(uint8_t event, uint8_t a, uint8_t b) {
+	if (dropped) {
+		if (push(Events::DROPPED, dropped >> 8, dropped))
+			dropped = 0;
+	}
+
+	if ((dropped || !push(event, a, b)) && dropped != UINT16_MAX)
+		++dropped;
+}
+
+bool Trace::flush() {
+	if (tail == head)
+		return false;
+
+	const Record& r = ring[tail];
+	const uint8_t bytes[RECORD_BYTES] = {
+		SYNC, r.event,
+		(uint8_t)(r.time >> 24), (uint8_t)(r.time >> 16),
+		(uint8_t)(r.time >> 8), (uint8_t)r.time,
+		r.a, r.b,
+	};
+	if (uart_try_write(bytes[sendPos])) {
+		if (++sendPos == RECORD_BYTES) {
+			sendPos = 0;
+			tail = (tail + 1) % RING_SIZE;
+		}
+	}
+	return true;
+}
+
+#endif // defined(ENABLE_TRACE)
@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2017-2025 3devo (http://www.3devo.eu)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+#include "Config.h"
+
+#if defined(ENABLE_TRACE)
+
+// Lightweight tracing for debugging timing-sensitive code (like the bus
+// drivers), where printf is too slow. Trace points store a small binary
+// record in a RAM ring buffer, which is sent out over the debug UART
+// (see uart.cpp) while the bootloader is idle. Use
+// tools/decode-trace.py to turn the output back into text.
+//
+// Each record is sent as 8 bytes: a 0xa5 sync byte, the event, a
+// big-endian timestamp in μs (see TimerMicros()) and two data bytes.
+class Trace {
+public:
+	// When adding events, also update tools/decode-trace.py
+	struct Events {
+		// a/b: Number of records dropped because the ring was full
+		static const uint8_t DROPPED          = 0x00;
+		// a/b: Low 16 bits of the bus ISR register
+		static const uint8_t BUS_ISR          = 0x01;
+		// a: Byte received
+		static const uint8_t BUS_RX           = 0x02;
+		// a: Byte sent
+		static const uint8_t BUS_TX           = 0x03;
+		// a: Byte dropped because the buffer is full
+		static const uint8_t BUS_RX_OVERFLOW  = 0x04;
+		// Master read more bytes than available
+		static const uint8_t BUS_TX_UNDERFLOW = 0x05;
+		// a: Number of bytes received
+		static const uint8_t BUS_FRAME_END    = 0x06;
+		// a: 0x01 for parity, 0x02 for framing, 0x04 for overrun
+		static const uint8_t BUS_RX_ERROR     = 0x07;
+		// a: Address, b: 0x01 when matched (ack'd), 0x02 for read
+		static const uint8_t BUS_ADDRESS      = 0x08;
+		// Stop or repeated start after a write
+		static const uint8_t BUS_STOP         = 0x09;
+	};
+
+	// Stores a record in the ring, or counts it as dropped when the
+	// ring is full.
+	static void record(uint8_t event, uint8_t a = 0, uint8_t b = 0);
+
+	// Sends the next byte from the ring when the UART is ready. Returns
+	// whether there is more data to send. Should be called
+	// repeatedly while idle.
+	static bool flush();
+};
+
+#define TRACE(event, ...) Trace::record(Trace::Events::event, ##__VA_ARGS__)
+
+#else
+
+#define TRACE(event, ...) do { } while (0)
+
+#endif // defined(ENABLE_TRACE)
+
+#endif /* TRACE_H_ */
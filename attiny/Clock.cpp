@@ -14,11 +14,53 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include "../Config.h"
 #include "../bootloader.h"
 
-void ClockInit() {
+bool ClockInit() {
 	// Nothing to do, clock is configured by fuses
+	return false;
 }
 
 void ClockDeinit() {
 }
+
+void ClockIdle(const volatile bool *done) {
+	// Idle mode only stops the CPU clock, so the TWI hardware keeps
+	// running and wakeup takes just a few cycles.
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	cli();
+	if (!*done) {
+		sleep_enable();
+		// The instruction after sei always runs before any
+		// interrupt, so this cannot miss an interrupt before
+		// sleeping.
+		sei();
+		sleep_cpu();
+		sleep_disable();
+	}
+	sei();
+}
+
+#if defined(NEED_TIMER)
+// Timer1 runs at F_CPU / 1024 (128μs at 8Mhz), so this wraps around
+// after 8.4s. Overflows are not counted, to keep this small.
+static const uint32_t TIMER_TICK_US = 1024 / (F_CPU / 1000000);
+
+void TimerInit() {
+	TCNT1 = 0;
+	TCCR1B = (1 << CS12) | (1 << CS10);
+}
+
+void TimerDeinit() {
+	TCCR1B = 0;
+	TCNT1 = 0;
+}
+
+uint32_t TimerMicros() {
+	return TCNT1 * TIMER_TICK_US;
+}
+#endif // defined(NEED_TIMER)
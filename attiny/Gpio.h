@@ -24,6 +24,12 @@ struct Pin {
 	void hiz() const;
 	void write(bool value) const;
 
+	// Same as read() and hiz(), provided for compatibility with
+	// stm32 (which needs a clock enabled for fast reads)
+	bool enableInput() const { hiz(); return true; }
+	bool readInput() const { return (*this->pin) & this->mask; }
+	void disable(bool /* clockWasEnabled */) const { hiz(); }
+
 	volatile uint8_t* port;
 	volatile uint8_t* pin;
 	volatile uint8_t* ddr;
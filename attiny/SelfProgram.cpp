@@ -37,18 +37,22 @@
 #error "FLASH_APP_OFFSET not supported"
 #endif
 
+#if defined(HAVE_EXTENDED_ADDRESSING)
+#error "HAVE_EXTENDED_ADDRESSING not supported"
+#endif
+
 // The actual value is set by main(), to avoid the overhead gcc
 // generates for running a "constructor" to set this value
 uint16_t SelfProgram::trampolineStart = 0;
 uint8_t SelfProgram::eraseCount = 0;
 
-void SelfProgram::readFlash(uint16_t address, uint8_t *data, uint16_t len) {
+void SelfProgram::readFlash(flash_addr_t address, uint8_t *data, uint16_t len) {
 	for (uint8_t i=0; i < len; i++) {
 		data[i] = readByte(address + i);
 	}
 }
 
-uint8_t SelfProgram::readByte(uint16_t address) {
+uint8_t SelfProgram::readByte(flash_addr_t address) {
 	// The first two bytes have been relocated to the end of flash,
 	// so read from there, and make sure to undo the changes made
 	if (address < 2) {
@@ -59,29 +63,42 @@ uint8_t SelfProgram::readByte(uint16_t address) {
 	return pgm_read_byte(address);
 }
 
-uint8_t SelfProgram::writePage(uint16_t address, uint8_t *data, uint16_t len) {
-	// Can only write to a 16 byte page boundary
-	if (!len || address % FLASH_WRITE_SIZE != 0 || len > FLASH_WRITE_SIZE) {
-		return 1;
+// The reset vector (pointing to the bootloader) that was present
+// before erasing page 0, to be restored when writing page 0.
+static uint16_t resetVector;
+
+uint8_t SelfProgram::erasePage(flash_addr_t address, uint8_t *data) {
+	// If the address is past the application section don't erase anything
+	if (address >= applicationSize) {
+		return 3;
 	}
 
-	// If we are writing page 0, change the reset vector
-	// so that it jumps to the bootloader.
 	if (address == 0) {
-		// Copy the reset vector from the data into the boot
-		// trampoline area
+		// Check the new reset vector before erasing anything,
+		// the trampoline will be written along with page 0.
 		uint16_t instruction = data[0] | (data[1] << 8);
-		instruction = offsetRelativeJump(instruction, -trampolineStart);
 		// Not a supported instruction? Return an error
-		if (!instruction)
+		if (!offsetRelativeJump(instruction, -trampolineStart))
 			return 2;
 
-		// Write the to-be-written reset vector to the trampoline
-		writeTrampoline(instruction);
-
 		// And preserve the current reset vector
-		data[0] = pgm_read_byte(0);
-		data[1] = pgm_read_byte(1);
+		resetVector = pgm_read_word(0);
+	}
+
+	// If this is the page containing the trampoline, it will
+	// already be erased when writing the first page
+	if (address / FLASH_ERASE_SIZE != trampolineStart / FLASH_ERASE_SIZE) {
+		if (eraseCount < 0xff)
+			++eraseCount;
+		boot_page_erase_safe(address);
+	}
+	return 0;
+}
+
+uint8_t SelfProgram::writePage(flash_addr_t address, const uint8_t *head, uint16_t headLen, const uint8_t *tail, uint16_t len) {
+	// Can only write to a 16 byte page boundary
+	if (!len || address % FLASH_WRITE_SIZE != 0 || len > FLASH_WRITE_SIZE) {
+		return 1;
 	}
 
 	// If the address is past the application section don't write anything
@@ -89,19 +106,24 @@ uint8_t SelfProgram::writePage(uint16_t address, uint8_t *data, uint16_t len) {
 		return 3;
 	}
 
-	// If we are the beginning of a 4-page boundary, erase it
-	if (address % FLASH_ERASE_SIZE == 0) {
-		// If this is the page containing the trampoline, it
-		// will already be erased when writing the first page
-		if (address / FLASH_ERASE_SIZE != trampolineStart / FLASH_ERASE_SIZE) {
-			if (eraseCount < 0xff)
-				++eraseCount;
-			boot_page_erase_safe(address);
-		}
-	}
+	auto byteAt = [=](uint16_t i) -> uint8_t {
+		if (i >= len)
+			return 0xff;
+		return i < headLen ? head[i] : tail[i - headLen];
+	};
+
+	// If we are writing page 0, copy the reset vector from the data
+	// into the boot trampoline area (erasePage already checked it).
+	// This must happen before filling the page buffer, since
+	// writeTrampoline uses it as well.
+	if (address == 0)
+		writeTrampoline(offsetRelativeJump(byteAt(0) | (byteAt(1) << 8), -trampolineStart));
 
 	for (uint16_t i = 0; i < len; i += 2) {
-		uint16_t w = data[i] | (data[i+1] << 8);
+		uint16_t w = byteAt(i) | (byteAt(i + 1) << 8);
+		// Keep the reset vector jumping to the bootloader
+		if (address + i == 0)
+			w = resetVector;
 		boot_page_fill_safe(address+i, w);
 	}
 	boot_page_write_safe(address);
@@ -109,6 +131,48 @@ uint8_t SelfProgram::writePage(uint16_t address, uint8_t *data, uint16_t len) {
 	return 0;
 }
 
+// Even bytes are kept here until the odd byte arrives, since the page
+// buffer can only be filled per word.
+static uint8_t pendingByte;
+
+void SelfProgram::fillPageBuffer(flash_addr_t address, uint8_t data) {
+	if (address % 2 == 0)
+		pendingByte = data;
+	else
+		boot_page_fill_safe(address, pendingByte | (data << 8));
+}
+
+uint8_t SelfProgram::writePageBuffer(flash_addr_t address, uint16_t len) {
+	// Flush a pending even byte
+	if (len % 2)
+		fillPageBuffer(address + len, 0xff);
+
+	if (!len || address % FLASH_WRITE_SIZE != 0 || len > FLASH_WRITE_SIZE) {
+		return 1;
+	}
+
+	// If the address is past the application section don't write anything
+	if (address + len > applicationSize) {
+		return 3;
+	}
+
+	boot_page_write_safe(address);
+	return 0;
+}
+
+void SelfProgram::clearPageBuffer() {
+	boot_spm_busy_wait();
+	// avr-libc has no macro for this, so this uses the same asm
+	// as its boot_page_fill
+	__asm__ __volatile__ (
+		"sts %0, %1\n\t"
+		"spm\n\t"
+		:
+		: "i" (_SFR_MEM_ADDR(__SPM_REG)),
+		  "r" ((uint8_t)(_BV(CTPB) | _BV(SPMEN)))
+	);
+}
+
 // This expects a rjmp or rcall instruction, which stores the
 // jump amount (relative to the current address) in the lower 12 bits.
 // The given offset (in bytes) is added to the jump amount.
@@ -20,10 +20,11 @@
 
 #include "../Bus.h"
 #include "../Config.h"
+#include "../Buffers.h"
 #include <avr/io.h>
 #include <avr/interrupt.h>
 
-void BusInit() {
+void BusInit(bool /* configured */) {
 	BusResetDeviceAddress();
 	TWSCRB = _BV(TWHNM);
 
@@ -66,7 +67,6 @@ static void _Acknowledge(bool ack, bool complete=false) {
 }
 
 
-static uint8_t twiBuffer[MAX_PACKET_LENGTH];
 static uint8_t twiBufferLen = 0;
 static uint8_t twiReadPos = 0;
 static uint8_t twiAddress = 0;
@@ -101,7 +101,7 @@ void BusUpdate() {
 	if (isAddressOrStop) {
 		// If we were previously in a write, then execute the callback and setup for a read.
 		if ((twiState == TWIStateWrite) and twiBufferLen != 0) {
-			twiBufferLen = BusCallback(twiAddress, twiBuffer, twiBufferLen, sizeof(twiBuffer));
+			twiBufferLen = BusCallback(twiAddress, buffers.bus, twiBufferLen, sizeof(buffers.bus));
 		}
 
 		// Send an ack unless a read is starting and there are no bytes to read.
@@ -126,7 +126,7 @@ void BusUpdate() {
 	// Data Read
 	if (dataInterruptFlag and isReadOperation) {
 		if (twiReadPos < twiBufferLen) {
-			TWSD = twiBuffer[twiReadPos++];
+			TWSD = buffers.bus[twiReadPos++];
 			_Acknowledge(true /*ack*/, false /*complete*/);
 		} else {
 			TWSD = 0;
@@ -140,8 +140,8 @@ void BusUpdate() {
 		uint8_t data = TWSD;
 		_Acknowledge(true, false);
 
-		if (twiBufferLen < sizeof(twiBuffer)) {
-			twiBuffer[twiBufferLen++] = data;
+		if (twiBufferLen < sizeof(buffers.bus)) {
+			buffers.bus[twiBufferLen++] = data;
 		}
 		return;
 	}
@@ -28,7 +28,9 @@ int uart_write(char byte, FILE *) {
 }
 
 
-void uart_init(void) {
+// Sets up the UART hardware only, for use with uart_try_write() (this
+// does not pull in stdio like uart_init() does).
+void uart_setup(void) {
 	UBRR0H = UBRRH_VALUE;
 	UBRR0L = UBRRL_VALUE;
 	#if USE_2X
@@ -39,8 +41,31 @@ void uart_init(void) {
 
 	UCSR0B = (1<<TXEN0);
 	UCSR0C = (1<<UCSZ01) | (1<<UCSZ00);
+}
+
+// Returns the UART to its reset state before starting the
+// application. The transmitter is only really disabled once the byte
+// in progress has been sent.
+void uart_deinit(void) {
+	UCSR0B = 0;
+	UCSR0A &= ~(1 << U2X0);
+	UBRR0H = 0;
+	UBRR0L = 0;
+}
+
+void uart_init(void) {
+	uart_setup();
+
 	static FILE stream;
 	fdev_setup_stream(&stream, uart_write, NULL, _FDEV_SETUP_WRITE);
 
 	stdout = &stream;
 }
+
+// Writes a byte if the UART is ready to accept it, without blocking
+bool uart_try_write(uint8_t byte) {
+	if (bit_is_clear(UCSR0A, UDRE0))
+		return false;
+	UDR0 = byte;
+	return true;
+}
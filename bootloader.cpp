@@ -22,6 +22,7 @@
 #include <util/delay.h>
 #elif defined(STM32)
 #include <libopencm3/stm32/desig.h>
+#include <libopencm3/stm32/memorymap.h>
 #endif
 #include <stdio.h>
 
@@ -29,6 +30,17 @@
 #include "Bus.h"
 #include "BaseProtocol.h"
 #include "SelfProgram.h"
+#include "Metadata.h"
+#include "PageDigests.h"
+#include "BootProfile.h"
+#include "CommandStats.h"
+#include "Trace.h"
+#include "RamUsage.h"
+#include "Buffers.h"
+#include "Crc.h"
+#if defined(HAVE_HANDOFF)
+#include "Handoff.h"
+#endif
 #include "bootloader.h"
 
 // Make boot_signature_byte_get work on ATtiny841, until this is merged:
@@ -45,6 +57,12 @@
 	#define pgm_read_dword(addr) (*(const uint32_t *)(addr))
 #endif
 
+// Flash addresses passed to SelfProgram are relative to the start of
+// flash, which is at 0 on AVR.
+#if !defined(FLASH_BASE)
+	#define FLASH_BASE 0
+#endif
+
 struct Commands {
 	// See also ProtocolCommands in BaseProtocol.h
 	static const uint8_t POWER_UP_DISPLAY      = 0x02;
@@ -59,17 +77,140 @@ struct Commands {
 	static const uint8_t SET_CHILD_SELECT      = 0x0b;
 	static const uint8_t GET_EXTRA_INFO        = 0x0d;
 	static const uint8_t READ_BOARD_INFO       = 0x0e;
+	static const uint8_t WRITE_FLASH_EXTENDED  = 0x0f;
+	static const uint8_t READ_FLASH_EXTENDED   = 0x10;
+	static const uint8_t GET_FLASH_SIZE        = 0x11;
+	static const uint8_t GET_IMAGE_MANIFEST    = 0x12;
+	static const uint8_t GET_PAGE_DIGESTS      = 0x13;
+	static const uint8_t RESUME_FLASH          = 0x14;
+	static const uint8_t GET_BOOT_TIMESTAMPS   = 0x15;
+	static const uint8_t GET_COMMAND_STATS     = 0x16;
+	static const uint8_t GET_BUS_STATS         = 0x17;
+	static const uint8_t GET_RAM_USAGE         = 0x18;
+	// 0x19 is BATCH in ProtocolCommands
+	static const uint8_t GET_DEVICE_DESCRIPTOR = 0x1a;
+	static const uint8_t GET_CAPABILITIES      = 0x1b;
+	static const uint8_t STREAM_FLASH          = 0x1c;
 };
 
 constexpr const uint8_t MAX_EXTRA_INFO = 16;
 
+// Flags for the FINALIZE_FLASH command
+constexpr const uint8_t FINALIZE_RETURN_CRC = 0x01;
+constexpr const uint8_t FINALIZE_STORE_MANIFEST = 0x02;
+
+// Modes for the STREAM_FLASH command
+constexpr const uint8_t STREAM_WRITE = 0x01;
+constexpr const uint8_t STREAM_READ = 0x02;
+
+// Flags for the GET_COMMAND_STATS command
+constexpr const uint8_t COMMAND_STATS_RESET = 0x01;
+
+// Flags for the GET_BUS_STATS command
+constexpr const uint8_t BUS_STATS_CLEAR = 0x01;
+
+// Bits for the GET_CAPABILITIES command
+struct Capabilities {
+	static const uint32_t DISPLAY             = 0x00000001;
+	static const uint32_t CHILD_SELECT        = 0x00000002;
+	static const uint32_t EXTENDED_ADDRESSING = 0x00000004;
+	static const uint32_t FINALIZE_CRC        = 0x00000008;
+	static const uint32_t IMAGE_MANIFEST      = 0x00000010;
+	static const uint32_t PAGE_DIGESTS        = 0x00000020;
+	static const uint32_t RESUME_FLASH        = 0x00000040;
+	static const uint32_t BOOT_TIMESTAMPS     = 0x00000080;
+	static const uint32_t COMMAND_STATS       = 0x00000100;
+	static const uint32_t BUS_STATS           = 0x00000200;
+	static const uint32_t RAM_USAGE           = 0x00000400;
+	static const uint32_t BATCH               = 0x00000800;
+	static const uint32_t DEVICE_DESCRIPTOR   = 0x00001000;
+	static const uint32_t SLOTTED_QUERY       = 0x00002000;
+	static const uint32_t SERIAL_SEARCH       = 0x00004000;
+	static const uint32_t STREAMING           = 0x00008000;
+};
+
+#if defined(HAVE_CAPABILITIES)
+constexpr const uint32_t CAPABILITIES = 0
+	#if defined(HAVE_DISPLAY)
+	| Capabilities::DISPLAY
+	#endif
+	#if defined(USE_CHILD_SELECT)
+	| Capabilities::CHILD_SELECT
+	#endif
+	#if defined(HAVE_EXTENDED_ADDRESSING)
+	| Capabilities::EXTENDED_ADDRESSING
+	#endif
+	#if defined(VERIFY_FLASH)
+	| Capabilities::FINALIZE_CRC
+	#endif
+	#if defined(HAVE_IMAGE_MANIFEST)
+	| Capabilities::IMAGE_MANIFEST
+	#endif
+	#if defined(HAVE_PAGE_DIGESTS)
+	| Capabilities::PAGE_DIGESTS
+	#endif
+	#if defined(HAVE_RESUME_FLASH)
+	| Capabilities::RESUME_FLASH
+	#endif
+	#if defined(HAVE_BOOT_PROFILE)
+	| Capabilities::BOOT_TIMESTAMPS
+	#endif
+	#if defined(HAVE_COMMAND_STATS)
+	| Capabilities::COMMAND_STATS
+	#endif
+	#if defined(HAVE_BUS_STATS)
+	| Capabilities::BUS_STATS
+	#endif
+	#if defined(HAVE_RAM_USAGE)
+	| Capabilities::RAM_USAGE
+	#endif
+	#if defined(HAVE_BATCH)
+	| Capabilities::BATCH
+	#endif
+	#if defined(HAVE_DEVICE_DESCRIPTOR)
+	| Capabilities::DEVICE_DESCRIPTOR
+	#endif
+	#if defined(HAVE_SLOTTED_QUERY) && defined(USE_RS485)
+	| Capabilities::SLOTTED_QUERY
+	#endif
+	#if defined(HAVE_SERIAL_SEARCH) && defined(USE_RS485)
+	| Capabilities::SERIAL_SEARCH
+	#endif
+	#if defined(HAVE_STREAMING) && defined(USE_I2C)
+	| Capabilities::STREAMING
+	#endif
+	;
+#endif // defined(HAVE_CAPABILITIES)
+
 volatile bool bootloaderExit = false;
 
-// Note that we must buffer a full erase page size (not smaller), since
-// we must know at the start of an erase page whether any byte in the
-// entire page is changed to decide whether or not to erase.
-static uint8_t writeBuffer[FLASH_ERASE_SIZE];
-static uint16_t nextWriteAddress = 0;
+Buffers buffers;
+
+#if !defined(USE_PAGE_BUFFER)
+// Number of bytes of the current erase page already programmed
+static uint16_t pageWritten = 0;
+#endif
+// Set when any byte written to the current erase page differs from
+// what is in flash already
+static bool pageDirty = false;
+static flash_addr_t nextWriteAddress = 0;
+
+#if defined(HAVE_RESUME_FLASH)
+#if !defined(HAVE_IMAGE_MANIFEST)
+#error "HAVE_RESUME_FLASH needs HAVE_IMAGE_MANIFEST for storing progress"
+#endif
+// Set by RESUME_FLASH until the next FINALIZE_FLASH. While set, the
+// progress of the upload is stored after each erase page written.
+static bool uploadSession = false;
+static uint8_t sessionTag[MANIFEST_TAG_SIZE];
+// The progress last stored
+static flash_addr_t sessionProgress;
+
+static uint8_t storeProgress(flash_addr_t length) {
+	sessionProgress = length;
+	return Metadata::writeProgress(length, sessionTag);
+}
+#endif // defined(HAVE_RESUME_FLASH)
 
 // This is a placeholder in flash, that should be replaced with the
 // actual board info contents while flashing the bootloader.
@@ -122,38 +263,188 @@ static uint8_t current_board_version;
 // error).
 void compiletime_check_failed();
 
-static bool equalToFlash(uint16_t address, uint16_t len) {
-	uint16_t offset = 0;
-	while (len > 0) {
-		if (writeBuffer[offset] != SelfProgram::readByte(FLASH_APP_OFFSET + address + offset))
-			return false;
-		--len;
-		++offset;
-	}
-	return true;
+#if defined(__AVR_ATtiny841__) || defined(__AVR_ATtiny441__)
+	// These are offsets into the device signature imprint table, which
+	// store the parts of the serial number (lot number, wafer number, x/y
+	// coordinates).
+	static const uint8_t PROGMEM serial_offset[] = {0x0e, 0x0f, 0x10, 0x11, 0x12, 0x13, 0x15, 0x16, 0x17};
+	static_assert(sizeof(serial_offset) == SERIAL_NUMBER_SIZE, "Wrong SERIAL_NUMBER_SIZE");
+#endif
+
+#if defined(HAVE_SERIAL_NUMBER)
+void readSerialNumber(uint8_t *buf) {
+	#if defined(__AVR_ATtiny841__) || defined(__AVR_ATtiny441__)
+	for (uint8_t i = 0; i < sizeof(serial_offset); ++i)
+		buf[i] = boot_signature_byte_get(pgm_read_byte(&serial_offset[i]));
+	#elif defined(STM32)
+	// This access the id bytes directly rather than using the
+	// desig_get_unique_id libopencm3 function, in order to use byte
+	// addressing (word addressing requires buf to be aligned) and
+	// so we can reverse the bytes (rather than the words) so the
+	// result has all bytes in big endian order.
+	// Note that that G030 does not document these bytes, but they
+	// seem to be available regardless (G030 seems to use the same
+	// core die as G031)
+	for (uint8_t i = 0; i < SERIAL_NUMBER_SIZE; ++i)
+		buf[i] = ((uint8_t*)DESIG_UNIQUE_ID_BASE)[SERIAL_NUMBER_SIZE - i - 1];
+	#endif
 }
+#endif // defined(HAVE_SERIAL_NUMBER)
 
+#if defined(HAVE_DEVICE_DESCRIPTOR)
+#if !defined(HAVE_SERIAL_NUMBER)
+#error "HAVE_DEVICE_DESCRIPTOR needs a serial number"
+#endif
 
-static uint8_t commitToFlash(uint16_t address, uint16_t len) {
-	// If nothing needs to be changed, then don't
-	if (equalToFlash(address, len))
-		return 0;
+// Everything returned by GET_DEVICE_DESCRIPTOR is fixed during a
+// session, so it is assembled once by buildDeviceDescriptor() and
+// returned as-is.
+static uint8_t deviceDescriptor[20 + SERIAL_NUMBER_SIZE + MAX_EXTRA_INFO];
+static uint8_t deviceDescriptorLen;
+
+static void buildDeviceDescriptor(uint32_t signature, uint16_t crc) {
+	uint8_t *out = deviceDescriptor;
+	*out++ = PROTOCOL_VERSION >> 8;
+	*out++ = PROTOCOL_VERSION & 0xff;
+	*out++ = INFO_HW_TYPE;
+	*out++ = compatible_board_version;
+	*out++ = current_board_version;
+	*out++ = BL_VERSION;
+	uint32_t size = SelfProgram::applicationSize;
+	*out++ = size >> 24;
+	*out++ = size >> 16;
+	*out++ = size >> 8;
+	*out++ = size;
+	*out++ = MAX_PACKET_LENGTH >> 8;
+	*out++ = MAX_PACKET_LENGTH & 0xff;
+	*out++ = SERIAL_NUMBER_SIZE;
+	readSerialNumber(out);
+	out += SERIAL_NUMBER_SIZE;
+	#if defined(BOARD_TYPE_interfaceboard)
+	*out++ = sizeof(extra_info);
+	memcpy(out, extra_info, sizeof(extra_info));
+	out += sizeof(extra_info);
+	#else
+	*out++ = 0;
+	#endif
+	*out++ = signature >> 24;
+	*out++ = signature >> 16;
+	*out++ = signature >> 8;
+	*out++ = signature;
+	*out++ = crc >> 8;
+	*out++ = crc;
+	deviceDescriptorLen = out - deviceDescriptor;
+}
+#endif // defined(HAVE_DEVICE_DESCRIPTOR)
 
-	uint16_t offset = 0;
-	while (len > 0) {
-		uint16_t pageLen = len < FLASH_WRITE_SIZE ? len : FLASH_WRITE_SIZE;
-		uint8_t err = SelfProgram::writePage(FLASH_APP_OFFSET + address + offset, &writeBuffer[offset], pageLen);
+static uint8_t erasePage(flash_addr_t pageAddress) {
+	#if defined(HAVE_IMAGE_MANIFEST)
+	uint8_t err;
+	#if defined(HAVE_RESUME_FLASH)
+	if (uploadSession) {
+		// Only pages before the stored progress are known to be
+		// complete, so when one of these is rewritten, move the
+		// progress back first.
+		err = pageAddress < sessionProgress ? storeProgress(pageAddress) : 0;
+	} else
+	#endif // defined(HAVE_RESUME_FLASH)
+	{
+		// The image is about to change, so the manifest no
+		// longer applies
+		err = Metadata::invalidate();
+	}
+	if (err)
+		return err;
+	#endif // defined(HAVE_IMAGE_MANIFEST)
+	#if defined(HAVE_PAGE_DIGESTS)
+	PageDigests::invalidate(pageAddress / FLASH_ERASE_SIZE);
+	#endif // defined(HAVE_PAGE_DIGESTS)
+	return SelfProgram::erasePage(FLASH_APP_OFFSET + pageAddress, buffers.write);
+}
+
+#if !defined(USE_PAGE_BUFFER)
+// Erases the page if needed and programs all rows of the page up to
+// end (page offset). Bytes before tailOffset are taken from buffers.write,
+// bytes after it from tail.
+static uint8_t writeRows(flash_addr_t pageAddress, uint16_t end, const uint8_t *tail, uint16_t tailOffset) {
+	uint8_t err;
+	if (pageWritten == 0) {
+		err = erasePage(pageAddress);
 		if (err)
 			return err;
-		len -= pageLen;
-		offset += pageLen;
+	}
+
+	while (pageWritten < end) {
+		uint16_t len = end - pageWritten;
+		if (len > FLASH_WRITE_SIZE)
+			len = FLASH_WRITE_SIZE;
+		uint16_t headLen = tailOffset - pageWritten;
+		if (headLen > len)
+			headLen = len;
+		err = SelfProgram::writePage(FLASH_APP_OFFSET + pageAddress + pageWritten, &buffers.write[pageWritten], headLen, tail, len);
+		#if defined(HAVE_PAGE_DIGESTS)
+		// The page is written over multiple packets, so it
+		// might have been digested halfway by update()
+		PageDigests::invalidate(pageAddress / FLASH_ERASE_SIZE);
+		#endif // defined(HAVE_PAGE_DIGESTS)
+		if (err)
+			return err;
+		pageWritten += len;
 	}
 	return 0;
 }
+#endif // !defined(USE_PAGE_BUFFER)
+
+static uint8_t commitToFlash(flash_addr_t address, uint16_t len) {
+	uint8_t err = 0;
+	// If nothing needs to be changed, then don't
+	if (pageDirty) {
+		#if defined(USE_PAGE_BUFFER)
+		err = erasePage(address);
+		// The page buffer holds the last write page, so write that
+		// first, before writePage needs the page buffer again.
+		if (!err && len > BUFFERED_SIZE)
+			err = SelfProgram::writePageBuffer(FLASH_APP_OFFSET + address + BUFFERED_SIZE, len - BUFFERED_SIZE);
 
-static cmd_result handleWriteFlash(uint16_t address, uint8_t *data, uint16_t len, uint8_t *dataout) {
-	if (address == 0)
+		uint16_t offset = 0;
+		while (!err && offset < len && offset < BUFFERED_SIZE) {
+			uint16_t pageLen = len - offset < FLASH_WRITE_SIZE ? len - offset : FLASH_WRITE_SIZE;
+			err = SelfProgram::writePage(FLASH_APP_OFFSET + address + offset, &buffers.write[offset], pageLen, nullptr, pageLen);
+			offset += pageLen;
+		}
+		#else
+		err = writeRows(address, len, nullptr, len);
+		#endif
+
+		#if defined(HAVE_RESUME_FLASH)
+		// Only record progress when something was written, so
+		// uploading an unchanged image does not wear the
+		// metadata page
+		if (!err && uploadSession && len == FLASH_ERASE_SIZE)
+			err = storeProgress(address + len);
+		#endif // defined(HAVE_RESUME_FLASH)
+	}
+
+	#if defined(USE_PAGE_BUFFER)
+	// Discard anything left in the page buffer
+	SelfProgram::clearPageBuffer();
+	#else
+	pageWritten = 0;
+	#endif
+	pageDirty = false;
+	return err;
+}
+
+static cmd_result handleWriteFlash(flash_addr_t address, uint8_t *data, uint16_t len, uint8_t *dataout) {
+	if (address == 0) {
 		nextWriteAddress = 0;
+		pageDirty = false;
+		#if defined(USE_PAGE_BUFFER)
+		SelfProgram::clearPageBuffer();
+		#else
+		pageWritten = 0;
+		#endif
+	}
 
 	// Only consecutive writes are supported
 	if (address != nextWriteAddress)
@@ -161,22 +452,122 @@ static cmd_result handleWriteFlash(uint16_t address, uint8_t *data, uint16_t len
 
 	nextWriteAddress += len;
 	while (address < nextWriteAddress) {
-		writeBuffer[address % sizeof(writeBuffer)] = *data;
+		uint16_t offset = address % FLASH_ERASE_SIZE;
+		uint8_t err = 0;
+
+		if (!pageDirty && *data != SelfProgram::readByte(FLASH_APP_OFFSET + address))
+			pageDirty = true;
+
+		#if defined(USE_PAGE_BUFFER)
+		if (offset >= BUFFERED_SIZE)
+			SelfProgram::fillPageBuffer(FLASH_APP_OFFSET + address, *data);
+		else
+			buffers.write[offset] = *data;
 		++data;
 		++address;
+		#else
+		uint16_t rowEnd = offset - offset % FLASH_WRITE_SIZE + FLASH_WRITE_SIZE;
+		flash_addr_t pageAddress = address - offset;
+		if (pageDirty && pageAddress + rowEnd <= nextWriteAddress) {
+			// The page will be erased and the rest of this row
+			// is in this packet, so program it straight from
+			// the bus buffer instead of copying it. Packets
+			// are smaller than a row, so the start of the row
+			// always comes from buffers.write: this only saves
+			// copying the last part of each row.
+			err = writeRows(pageAddress, rowEnd, data, offset);
+			data += rowEnd - offset;
+			address = pageAddress + rowEnd;
+		} else {
+			buffers.write[offset] = *data;
+			++data;
+			++address;
+		}
+		#endif
 
-		if (address % sizeof(writeBuffer) == 0) {
-			uint8_t err = commitToFlash(address - sizeof(writeBuffer), sizeof(writeBuffer));
-			if (err) {
-				dataout[0] = err;
-				return cmd_result(Status::COMMAND_FAILED, 1);
-			}
+		if (!err && address % FLASH_ERASE_SIZE == 0)
+			err = commitToFlash(address - FLASH_ERASE_SIZE, FLASH_ERASE_SIZE);
+
+		if (err) {
+			dataout[0] = err;
+			return cmd_result(Status::COMMAND_FAILED, 1);
 		}
 	}
 
 	return cmd_ok();
 }
 
+#if defined(HAVE_STREAMING) && defined(USE_I2C)
+// The stream started by STREAM_FLASH, or 0 when there is none
+static uint8_t streamMode = 0;
+static flash_addr_t streamAddress;
+static flash_addr_t streamRemaining;
+// Result of a write stream so far, and the error code for
+// COMMAND_FAILED
+static cmd_result streamResult(Status::COMMAND_OK);
+static uint8_t streamError;
+// CRC over the data of a read stream, and how many of its bytes
+// still need to be sent after the data
+static Crc16Ccitt streamCrc;
+static uint8_t streamCrcLeft;
+
+bool BusStreamBegin(uint8_t address, bool read) {
+	// General calls are never part of a stream
+	return address != 0 && streamMode == (read ? STREAM_READ : STREAM_WRITE);
+}
+
+void BusStreamWrite(uint8_t *buffer, uint8_t len) {
+	// Once something went wrong, ignore the rest of the data
+	if (streamResult.status != Status::COMMAND_OK)
+		return;
+
+	if (len > streamRemaining) {
+		streamResult = cmd_result(Status::INVALID_TRANSFER);
+		return;
+	}
+
+	streamResult = handleWriteFlash(streamAddress, buffer, len, &streamError);
+	streamAddress += len;
+	streamRemaining -= len;
+}
+
+uint8_t BusStreamRead(uint8_t *buffer, uint8_t maxLen) {
+	uint8_t len = 0;
+	if (streamRemaining) {
+		len = streamRemaining < maxLen ? streamRemaining : maxLen;
+		SelfProgram::readFlash(FLASH_APP_OFFSET + streamAddress, buffer, len);
+		streamCrc.update(buffer, len);
+		streamAddress += len;
+		streamRemaining -= len;
+	}
+
+	// The data is followed by its CRC, MSB first
+	while (streamRemaining == 0 && streamCrcLeft && len < maxLen)
+		buffer[len++] = streamCrc.get() >> (--streamCrcLeft * 8);
+	return len;
+}
+
+int BusStreamEnd(uint8_t *buffer, uint8_t len, uint8_t maxLen) {
+	// A stream is always a single transaction
+	uint8_t mode = streamMode;
+	streamMode = 0;
+
+	// Read streams have no reply
+	if (mode != STREAM_WRITE || maxLen < 4)
+		return 0;
+
+	if (len)
+		BusStreamWrite(buffer, len);
+
+	// The master ended the transaction early
+	if (streamResult.status == Status::COMMAND_OK && streamRemaining)
+		streamResult = cmd_result(Status::INVALID_TRANSFER);
+
+	buffer[2] = streamError;
+	return finishReply(buffer, streamResult);
+}
+#endif // defined(HAVE_STREAMING) && defined(USE_I2C)
+
 #ifdef HAVE_DISPLAY
 void displayOn() {
 	// This pin has a pullup to 3v3, so the display comes out of
@@ -228,7 +619,12 @@ cmd_result processCommand(uint8_t cmd, uint8_t *datain, uint8_t len, uint8_t *da
 			dataout[2] = BL_VERSION;
 			// Available flash size is up to startApplication.
 			// Convert from words to bytes.
-			uint16_t size = SelfProgram::applicationSize;
+			flash_addr_t size = SelfProgram::applicationSize;
+			#if defined(HAVE_EXTENDED_ADDRESSING)
+			// Bigger sizes can be read with GET_FLASH_SIZE
+			if (size > 0xffff)
+				size = 0xffff;
+			#endif
 			dataout[3] = size >> 8;
 			dataout[4] = size;
 			return cmd_ok(5);
@@ -241,47 +637,272 @@ cmd_result processCommand(uint8_t cmd, uint8_t *datain, uint8_t len, uint8_t *da
 			dataout[0] = current_board_version;
 			return cmd_ok(1);
 		}
-		case Commands::GET_SERIAL_NUMBER:
+		#if defined(HAVE_EXTENDED_ADDRESSING)
+		case Commands::GET_FLASH_SIZE:
 		{
 			if (len != 0)
 				return cmd_result(Status::INVALID_ARGUMENTS);
 
-			#if defined(__AVR_ATtiny841__) || defined(__AVR_ATtiny441__)
-			// These are offsets into the device signature imprint table, which
-			// store the parts of the serial number (lot number, wafer number, x/y
-			// coordinates).
-			static const uint8_t PROGMEM serial_offset[] = {0x0e, 0x0f, 0x10, 0x11, 0x12, 0x13, 0x15, 0x16, 0x17};
+			flash_addr_t size = SelfProgram::applicationSize;
+			dataout[0] = size >> 24;
+			dataout[1] = size >> 16;
+			dataout[2] = size >> 8;
+			dataout[3] = size;
+			return cmd_ok(4);
+		}
+		#endif // defined(HAVE_EXTENDED_ADDRESSING)
+		#if defined(HAVE_IMAGE_MANIFEST)
+		case Commands::GET_IMAGE_MANIFEST:
+		{
+			if (len != 0)
+				return cmd_result(Status::INVALID_ARGUMENTS);
 
-			if (maxLen < sizeof(serial_offset))
+			MetadataRecord manifest;
+			if (!Metadata::readManifest(&manifest))
+				return cmd_ok(0);
+
+			if (maxLen < 8 + MANIFEST_TAG_SIZE)
 				compiletime_check_failed();
 
-			for (uint8_t i = 0; i < sizeof(serial_offset); ++i)
-				dataout[i] = boot_signature_byte_get(pgm_read_byte(&serial_offset[i]));
-			return cmd_ok(sizeof(serial_offset));
-			#elif defined(STM32)
-			const size_t id_size = 12;
-			if (maxLen < id_size)
+			dataout[0] = manifest.length >> 24;
+			dataout[1] = manifest.length >> 16;
+			dataout[2] = manifest.length >> 8;
+			dataout[3] = manifest.length;
+			dataout[4] = manifest.crc >> 24;
+			dataout[5] = manifest.crc >> 16;
+			dataout[6] = manifest.crc >> 8;
+			dataout[7] = manifest.crc;
+			memcpy(dataout + 8, manifest.tag, MANIFEST_TAG_SIZE);
+			return cmd_ok(8 + MANIFEST_TAG_SIZE);
+		}
+		#endif // defined(HAVE_IMAGE_MANIFEST)
+		#if defined(HAVE_RESUME_FLASH)
+		case Commands::RESUME_FLASH:
+		{
+			if (len != MANIFEST_TAG_SIZE)
+				return cmd_result(Status::INVALID_ARGUMENTS);
+
+			memcpy(sessionTag, datain, MANIFEST_TAG_SIZE);
+
+			MetadataRecord progress;
+			uint8_t err = 0;
+			if (Metadata::last(&progress) && progress.type == Metadata::Types::PROGRESS && !memcmp(progress.tag, sessionTag, MANIFEST_TAG_SIZE)) {
+				sessionProgress = progress.length;
+			} else {
+				// Start a new upload. Storing the
+				// progress now also marks the current
+				// image as no longer valid.
+				err = storeProgress(0);
+			}
+
+			if (err) {
+				dataout[0] = err;
+				return cmd_result(Status::COMMAND_FAILED, 1);
+			}
+
+			// Continue writing after the last complete page
+			uploadSession = true;
+			nextWriteAddress = sessionProgress;
+			pageDirty = false;
+			#if !defined(USE_PAGE_BUFFER)
+			pageWritten = 0;
+			#endif
+
+			dataout[0] = sessionProgress >> 24;
+			dataout[1] = sessionProgress >> 16;
+			dataout[2] = sessionProgress >> 8;
+			dataout[3] = sessionProgress;
+			return cmd_ok(4);
+		}
+		#endif // defined(HAVE_RESUME_FLASH)
+		#if defined(HAVE_PAGE_DIGESTS)
+		case Commands::GET_PAGE_DIGESTS:
+		{
+			if (len != 3)
+				return cmd_result(Status::INVALID_ARGUMENTS);
+
+			uint16_t page = datain0 << 8 | datain1;
+			uint8_t count = datain2;
+
+			if (2 + count * 4 > maxLen)
+				return cmd_result(Status::INVALID_ARGUMENTS);
+
+			// Return only the pages that exist
+			if (page >= PageDigests::NUM_PAGES)
+				count = 0;
+			else if (count > PageDigests::NUM_PAGES - page)
+				count = PageDigests::NUM_PAGES - page;
+
+			dataout[0] = FLASH_ERASE_SIZE >> 8;
+			dataout[1] = FLASH_ERASE_SIZE & 0xff;
+			uint8_t *out = dataout + 2;
+			while (count--) {
+				uint32_t digest = PageDigests::get(page++);
+				*out++ = digest >> 24;
+				*out++ = digest >> 16;
+				*out++ = digest >> 8;
+				*out++ = digest;
+			}
+			return cmd_ok(out - dataout);
+		}
+		#endif // defined(HAVE_PAGE_DIGESTS)
+		#if defined(HAVE_BOOT_PROFILE)
+		case Commands::GET_BOOT_TIMESTAMPS:
+		{
+			if (len != 0)
+				return cmd_result(Status::INVALID_ARGUMENTS);
+
+			if (maxLen < BootProfile::NUM_POINTS * 4)
+				compiletime_check_failed();
+
+			uint8_t *out = dataout;
+			for (uint8_t i = 0; i < BootProfile::NUM_POINTS; ++i) {
+				uint32_t timestamp = BootProfile::timestamps[i];
+				*out++ = timestamp >> 24;
+				*out++ = timestamp >> 16;
+				*out++ = timestamp >> 8;
+				*out++ = timestamp;
+			}
+			return cmd_ok(out - dataout);
+		}
+		#endif // defined(HAVE_BOOT_PROFILE)
+		#if defined(HAVE_COMMAND_STATS)
+		case Commands::GET_COMMAND_STATS:
+		{
+			if (len != 2)
+				return cmd_result(Status::INVALID_ARGUMENTS);
+
+			const CommandStats::Entry *entry = CommandStats::get(datain0);
+			if (!entry)
+				return cmd_result(Status::INVALID_ARGUMENTS);
+
+			if (maxLen < 10 + CommandStats::NUM_BUCKETS * 2)
 				compiletime_check_failed();
 
-			// This access the id bytes directly rather than
-			// using the desig_get_unique_id libopencm3
-			// function, in order to use byte addressing
-			// (word addressing requires dataout to be
-			// aligned) and so we can reverse the bytes
-			// (rather than the words) so the result has all
-			// bytes in big endian order.
-			// Note that that G030 does not document these
-			// bytes, but they seem to be available
-			// regardless (G030 seems to use the same core
-			// die as G031)
-			for (uint8_t i = 0; i < id_size; ++i)
-				dataout[i] = ((uint8_t*)DESIG_UNIQUE_ID_BASE)[id_size - i - 1];
-
-			return cmd_ok(id_size);
+			uint8_t *out = dataout;
+			*out++ = entry->count >> 8;
+			*out++ = entry->count;
+			uint32_t min = entry->count ? entry->min : 0;
+			*out++ = min >> 24;
+			*out++ = min >> 16;
+			*out++ = min >> 8;
+			*out++ = min;
+			*out++ = entry->max >> 24;
+			*out++ = entry->max >> 16;
+			*out++ = entry->max >> 8;
+			*out++ = entry->max;
+			for (uint8_t i = 0; i < CommandStats::NUM_BUCKETS; ++i) {
+				*out++ = entry->buckets[i] >> 8;
+				*out++ = entry->buckets[i];
+			}
+
+			if (datain1 & COMMAND_STATS_RESET)
+				CommandStats::reset(datain0);
+
+			return cmd_ok(out - dataout);
+		}
+		#endif // defined(HAVE_COMMAND_STATS)
+		#if defined(HAVE_BUS_STATS)
+		case Commands::GET_BUS_STATS:
+		{
+			if (len != 1)
+				return cmd_result(Status::INVALID_ARGUMENTS);
+
+			if (maxLen < sizeof(busStats))
+				compiletime_check_failed();
+
+			// With -fpack-struct, busStats might not be aligned, so
+			// copy each counter instead of using word loads
+			const uint8_t *in = (const uint8_t*)&busStats;
+			uint8_t *out = dataout;
+			for (uint8_t i = 0; i < sizeof(busStats); i += sizeof(uint32_t)) {
+				uint32_t counter;
+				memcpy(&counter, in + i, sizeof(counter));
+				*out++ = counter >> 24;
+				*out++ = counter >> 16;
+				*out++ = counter >> 8;
+				*out++ = counter;
+			}
+
+			if (datain0 & BUS_STATS_CLEAR)
+				memset(&busStats, 0, sizeof(busStats));
+
+			return cmd_ok(out - dataout);
+		}
+		#endif // defined(HAVE_BUS_STATS)
+		#if defined(HAVE_RAM_USAGE)
+		case Commands::GET_RAM_USAGE:
+		{
+			if (len != 0)
+				return cmd_result(Status::INVALID_ARGUMENTS);
+
+			if (maxLen < 6)
+				compiletime_check_failed();
+
+			uint16_t total = RamUsage::total();
+			uint16_t statics = RamUsage::statics();
+			uint16_t stack = RamUsage::maxStack();
+			dataout[0] = total >> 8;
+			dataout[1] = total;
+			dataout[2] = statics >> 8;
+			dataout[3] = statics;
+			dataout[4] = stack >> 8;
+			dataout[5] = stack;
+			return cmd_ok(6);
+		}
+		#endif // defined(HAVE_RAM_USAGE)
+		case Commands::GET_SERIAL_NUMBER:
+		{
+			if (len != 0)
+				return cmd_result(Status::INVALID_ARGUMENTS);
+
+			#if defined(HAVE_SERIAL_NUMBER)
+			if (maxLen < SERIAL_NUMBER_SIZE)
+				compiletime_check_failed();
+
+			readSerialNumber(dataout);
+			return cmd_ok(SERIAL_NUMBER_SIZE);
 			#else
 			return cmd_result(Status::COMMAND_NOT_SUPPORTED);
 			#endif
 		}
+		#if defined(HAVE_DEVICE_DESCRIPTOR)
+		case Commands::GET_DEVICE_DESCRIPTOR:
+		{
+			if (len != 0)
+				return cmd_result(Status::INVALID_ARGUMENTS);
+
+			if (maxLen < sizeof(deviceDescriptor))
+				compiletime_check_failed();
+
+			memcpy(dataout, deviceDescriptor, deviceDescriptorLen);
+			return cmd_ok(deviceDescriptorLen);
+		}
+		#endif // defined(HAVE_DEVICE_DESCRIPTOR)
+		#if defined(HAVE_CAPABILITIES)
+		case Commands::GET_CAPABILITIES:
+		{
+			if (len != 0)
+				return cmd_result(Status::INVALID_ARGUMENTS);
+
+			if (maxLen < 12)
+				compiletime_check_failed();
+
+			dataout[0] = CAPABILITIES >> 24;
+			dataout[1] = CAPABILITIES >> 16;
+			dataout[2] = CAPABILITIES >> 8;
+			dataout[3] = CAPABILITIES & 0xff;
+			dataout[4] = FLASH_ERASE_SIZE >> 8;
+			dataout[5] = FLASH_ERASE_SIZE & 0xff;
+			dataout[6] = FLASH_WRITE_SIZE >> 8;
+			dataout[7] = FLASH_WRITE_SIZE & 0xff;
+			dataout[8] = (uint32_t)FLASH_APP_OFFSET >> 24;
+			dataout[9] = (uint32_t)FLASH_APP_OFFSET >> 16;
+			dataout[10] = (uint32_t)FLASH_APP_OFFSET >> 8;
+			dataout[11] = (uint32_t)FLASH_APP_OFFSET & 0xff;
+			return cmd_ok(12);
+		}
+		#endif // defined(HAVE_CAPABILITIES)
 		case Commands::START_APPLICATION:
 			if (len != 0)
 				return cmd_result(Status::INVALID_ARGUMENTS);
@@ -291,37 +912,108 @@ cmd_result processCommand(uint8_t cmd, uint8_t *datain, uint8_t len, uint8_t *da
 			return cmd_ok();
 
 		case Commands::WRITE_FLASH:
+		#if defined(HAVE_EXTENDED_ADDRESSING)
+		case Commands::WRITE_FLASH_EXTENDED:
+		#endif
 		{
-			if (len < 2)
+			uint8_t addressLen = 2;
+			#if defined(HAVE_EXTENDED_ADDRESSING)
+			if (cmd == Commands::WRITE_FLASH_EXTENDED)
+				addressLen = 4;
+			#endif
+
+			if (len < addressLen)
 				return cmd_result(Status::INVALID_ARGUMENTS);
 
-			uint16_t address = datain0 << 8 | datain1;
-			return handleWriteFlash(address, datain + 2, len - 2, dataout);
+			flash_addr_t address = datain0 << 8 | datain1;
+			#if defined(HAVE_EXTENDED_ADDRESSING)
+			if (addressLen == 4)
+				address = address << 16 | datain2 << 8 | datain[3];
+			#endif
+
+			return handleWriteFlash(address, datain + addressLen, len - addressLen, dataout);
 		}
 		case Commands::FINALIZE_FLASH:
 		{
+			#if defined(VERIFY_FLASH)
+			#if defined(HAVE_IMAGE_MANIFEST)
+			const uint8_t supportedFlags = FINALIZE_RETURN_CRC | FINALIZE_STORE_MANIFEST;
+			#else
+			const uint8_t supportedFlags = FINALIZE_RETURN_CRC;
+			#endif
+			uint8_t flags = len ? datain0 : 0;
+			uint8_t expectedLen = len ? 1 : 0;
+			#if defined(HAVE_IMAGE_MANIFEST)
+			// A manifest tag follows the flags
+			if (flags & FINALIZE_STORE_MANIFEST)
+				expectedLen += MANIFEST_TAG_SIZE;
+			#endif // defined(HAVE_IMAGE_MANIFEST)
+			if (len != expectedLen || (flags & ~supportedFlags))
+				return cmd_result(Status::INVALID_ARGUMENTS);
+			#else
 			if (len != 0)
 				return cmd_result(Status::INVALID_ARGUMENTS);
+			#endif
 
-			uint16_t pageAddress = nextWriteAddress & ~(sizeof(writeBuffer) - 1);
+			flash_addr_t pageAddress = nextWriteAddress & ~(flash_addr_t)(FLASH_ERASE_SIZE - 1);
 			uint8_t err = commitToFlash(pageAddress, nextWriteAddress - pageAddress);
+			#if defined(VERIFY_FLASH)
+			uint32_t crc = 0;
+			if (!err && flags)
+				crc = SelfProgram::crc32(FLASH_APP_OFFSET, nextWriteAddress);
+			#endif // defined(VERIFY_FLASH)
+			#if defined(HAVE_RESUME_FLASH)
+			// The upload is complete, so the progress is no
+			// longer needed (a manifest replaces it)
+			if (!err && uploadSession && !(flags & FINALIZE_STORE_MANIFEST))
+				err = Metadata::invalidate();
+			uploadSession = false;
+			#endif // defined(HAVE_RESUME_FLASH)
+			#if defined(HAVE_IMAGE_MANIFEST)
+			if (!err && (flags & FINALIZE_STORE_MANIFEST))
+				err = Metadata::writeManifest(nextWriteAddress, crc, datain + 1);
+			#endif // defined(HAVE_IMAGE_MANIFEST)
 			if (err) {
 				dataout[0] = err;
 				return cmd_result(Status::COMMAND_FAILED, 1);
 			} else {
 				dataout[0] = SelfProgram::eraseCount;
 				SelfProgram::eraseCount = 0;
+				#if defined(VERIFY_FLASH)
+				if (flags & FINALIZE_RETURN_CRC) {
+					dataout[1] = crc >> 24;
+					dataout[2] = crc >> 16;
+					dataout[3] = crc >> 8;
+					dataout[4] = crc;
+					return cmd_ok(5);
+				}
+				#endif // defined(VERIFY_FLASH)
 				return cmd_ok(1);
 			}
 		}
 		case Commands::READ_FLASH:
 		case Commands::READ_BOARD_INFO:
+		#if defined(HAVE_EXTENDED_ADDRESSING)
+		case Commands::READ_FLASH_EXTENDED:
+		#endif
 		{
+			#if defined(HAVE_EXTENDED_ADDRESSING)
+			bool extended = (cmd == Commands::READ_FLASH_EXTENDED);
+			if (len != (extended ? 5 : 3))
+				return cmd_result(Status::INVALID_ARGUMENTS);
+			#else
 			if (len != 3)
 				return cmd_result(Status::INVALID_ARGUMENTS);
+			#endif
 
-			uint16_t address = datain0 << 8 | datain1;
+			flash_addr_t address = datain0 << 8 | datain1;
 			uint8_t len = datain2;
+			#if defined(HAVE_EXTENDED_ADDRESSING)
+			if (extended) {
+				address = address << 16 | datain2 << 8 | datain[3];
+				len = datain[4];
+			}
+			#endif
 
 			if (len > maxLen)
 				return cmd_result(Status::INVALID_ARGUMENTS);
@@ -331,7 +1023,7 @@ cmd_result processCommand(uint8_t cmd, uint8_t *datain, uint8_t len, uint8_t *da
 					len = 0;
 				else if (len > sizeof(BOARD_INFO) - address)
 					len = sizeof(BOARD_INFO) - address;
-				address += reinterpret_cast<uintptr_t>(&BOARD_INFO);
+				address += reinterpret_cast<uintptr_t>(&BOARD_INFO) - FLASH_BASE;
 			} else {
 				address += FLASH_APP_OFFSET;
 			}
@@ -339,6 +1031,31 @@ cmd_result processCommand(uint8_t cmd, uint8_t *datain, uint8_t len, uint8_t *da
 			SelfProgram::readFlash(address, dataout, len);
 			return cmd_ok(len);
 		}
+		#if defined(HAVE_STREAMING) && defined(USE_I2C)
+		case Commands::STREAM_FLASH:
+		{
+			if (len != 9 || (datain0 != STREAM_WRITE && datain0 != STREAM_READ))
+				return cmd_result(Status::INVALID_ARGUMENTS);
+
+			uint32_t address = (uint32_t)datain1 << 24 | (uint32_t)datain2 << 16 | datain[3] << 8 | datain[4];
+			uint32_t length = (uint32_t)datain[5] << 24 | (uint32_t)datain[6] << 16 | datain[7] << 8 | datain[8];
+			if (length == 0 || length > SelfProgram::applicationSize || address > SelfProgram::applicationSize - length)
+				return cmd_result(Status::INVALID_ARGUMENTS);
+
+			// Only consecutive writes are supported, just like
+			// with WRITE_FLASH
+			if (datain0 == STREAM_WRITE && address != 0 && address != nextWriteAddress)
+				return cmd_result(Status::INVALID_ARGUMENTS);
+
+			streamMode = datain0;
+			streamAddress = address;
+			streamRemaining = length;
+			streamResult = cmd_ok();
+			streamCrc.reset();
+			streamCrcLeft = sizeof(streamCrc.get());
+			return cmd_ok();
+		}
+		#endif // defined(HAVE_STREAMING) && defined(USE_I2C)
 		#if defined(USE_CHILD_SELECT)
 		case Commands::GET_NUM_CHILDREN:
 		{
@@ -388,15 +1105,74 @@ cmd_result processCommand(uint8_t cmd, uint8_t *datain, uint8_t len, uint8_t *da
 	}
 }
 
+#if defined(FAST_BOOT)
+#if !defined(HAVE_IMAGE_MANIFEST)
+#error "FAST_BOOT needs HAVE_IMAGE_MANIFEST (make IMAGE_MANIFEST=1) to check the application"
+#endif
+
+bool fastBootAllowed() {
+	#if defined(HAVE_HANDOFF)
+	// The application explicitly asked for the bootloader
+	BootloaderHandoff entry;
+	if (readBootloaderHandoff(&entry, BootloaderHandoff::TO_BOOTLOADER))
+		return false;
+	#endif // defined(HAVE_HANDOFF)
+
+	// After a software reset (e.g. the RESET general call) or
+	// watchdog reset, the bootloader should stay active
+	if (!resetWasColdBoot())
+		return false;
+
+	#if defined(USE_CHILD_SELECT)
+	// The master can keep the child in the bootloader by asserting
+	// its child select pin (active low) during poweron
+	if (!CHILD_SELECT_PIN.read())
+		return false;
+	#endif // defined(USE_CHILD_SELECT)
+
+	MetadataRecord manifest;
+	if (!Metadata::readManifest(&manifest) || manifest.length == 0 || manifest.length > SelfProgram::applicationSize)
+		return false;
+
+	// Check the entire image, to not start an application that was
+	// corrupted somehow
+	return SelfProgram::crc32(FLASH_APP_OFFSET, manifest.length) == manifest.crc;
+}
+#endif // defined(FAST_BOOT)
+
 extern "C" {
 	void runBootloader() {
+		#if defined(HAVE_HANDOFF)
+		// When the application jumped here directly, continue
+		// with its bus address and setup (see Handoff.h)
+		BootloaderHandoff entry;
+		bool entered = readBootloaderHandoff(&entry, BootloaderHandoff::TO_BOOTLOADER);
+		if (entered)
+			clearBootloaderHandoff();
+
+		bool clockChanged = ClockInit();
+		BOOT_PROFILE(CLOCK_READY);
+		BusInit(entered && (entry.flags & BootloaderHandoff::Flags::BUS_CONFIGURED) && !clockChanged);
+		if (entered && entry.address)
+			setConfiguredAddress(entry.address);
+		#else
 		ClockInit();
+		BOOT_PROFILE(CLOCK_READY);
 		BusInit();
+		#endif // defined(HAVE_HANDOFF)
+		BOOT_PROFILE(BUS_READY);
+
+		#if defined(USE_CHILD_SELECT)
+		// Leave the pin enabled for the entire session, so checking
+		// it for every frame is fast
+		bool childSelectClock = CHILD_SELECT_PIN.enableInput();
+		#endif // defined(USE_CHILD_SELECT)
 
 		auto board_info = reinterpret_cast<const volatile BoardInfoV2*>(&BOARD_INFO);
 		uint32_t signature = pgm_read_dword(&board_info->signature);
 		uint8_t block_version = pgm_read_word(&board_info->block_version_major);
-		if (signature == BOARD_INFO_SIGNATURE && block_version == BOARD_INFO_MAJOR_VERSION) {
+		bool board_info_valid = (signature == BOARD_INFO_SIGNATURE && block_version == BOARD_INFO_MAJOR_VERSION);
+		if (board_info_valid) {
 			current_board_version = pgm_read_byte(&board_info->current_board_version);
 			compatible_board_version = pgm_read_byte(&board_info->compatible_board_version);
 			#if defined(BOARD_TYPE_interfaceboard)
@@ -418,15 +1194,66 @@ extern "C" {
 			current_board_version = 0xff;
 			compatible_board_version = 0xff;
 		}
-
+		#if defined(HAVE_DEVICE_DESCRIPTOR)
+		buildDeviceDescriptor(signature, pgm_read_word(&board_info->crc));
+		#endif // defined(HAVE_DEVICE_DESCRIPTOR)
+		BOOT_PROFILE(BOARD_INFO);
 
 		while (!bootloaderExit) {
+			bool busy = false;
 			#if !defined(BUS_USE_INTERRUPTS)
 			BusUpdate();
 			#endif // defined(BUS_USE_INTERRUPTS)
+			#if defined(HAVE_PAGE_DIGESTS)
+			// Use idle time to prepare page digests
+			busy = PageDigests::update();
+			#endif // defined(HAVE_PAGE_DIGESTS)
+			#if defined(ENABLE_TRACE)
+			Trace::flush();
+			#endif // defined(ENABLE_TRACE)
+			#if defined(BUS_USE_INTERRUPTS) && !defined(ENABLE_TRACE)
+			// Everything else happens in the bus interrupt,
+			// so sleep until the next one once the digests
+			// are done. Tracing needs this loop to keep
+			// running to send out its data.
+			if (!busy)
+				ClockIdle(&bootloaderExit);
+			#endif // defined(BUS_USE_INTERRUPTS) && !defined(ENABLE_TRACE)
+			(void)busy;
 		}
 
+		#if defined(ENABLE_TRACE)
+		// Send out everything before the application takes over
+		while (Trace::flush()) /* nothing */;
+		#endif // defined(ENABLE_TRACE)
+
+		#if defined(HAVE_HANDOFF)
+		// Tell the application what we already know, so it
+		// does not need to be told again (see Handoff.h)
+		BootloaderHandoff handoff;
+		memset(&handoff, 0, sizeof(handoff));
+		handoff.address = getConfiguredAddress();
+		handoff.current_board_version = current_board_version;
+		handoff.compatible_board_version = compatible_board_version;
+		if (board_info_valid) {
+			handoff.manufacturer_id = pgm_read_byte(&board_info->manufacturer_id);
+			handoff.board_number = pgm_read_word(&board_info->board_number);
+			handoff.component_variations = pgm_read_dword(&board_info->component_variations);
+		}
+		#if defined(USE_RS485)
+		handoff.baud_rate = RS485_BAUD_RATE;
+		#endif
+		writeBootloaderHandoff(&handoff, BootloaderHandoff::TO_APPLICATION);
+		#endif // defined(HAVE_HANDOFF)
+
 		BusDeinit();
+		#if defined(USE_CHILD_SELECT)
+		// After BusDeinit(), which might use the same port
+		CHILD_SELECT_PIN.disable(childSelectClock);
+		#endif // defined(USE_CHILD_SELECT)
 		ClockDeinit();
+		#if defined(NEED_TIMER)
+		TimerDeinit();
+		#endif // defined(NEED_TIMER)
 	}
 }
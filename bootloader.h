@@ -18,14 +18,30 @@
 #ifndef BOOTLOADER_H_
 #define BOOTLOADER_H_
 
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 void runBootloader();
-void ClockInit();
+#if defined(FAST_BOOT)
+bool fastBootAllowed();
+#endif // defined(FAST_BOOT)
+// Returns true when the peripheral clock frequency was changed, so
+// any existing bus setup must be redone.
+bool ClockInit();
 void ClockDeinit();
+// Sleeps until the next interrupt, unless *done is already set. This
+// check is done with interrupts disabled, so an interrupt that sets
+// done right before sleeping is not missed.
+void ClockIdle(const volatile bool *done);
+
+// Free-running timer for measurements, only available when NEED_TIMER
+// is defined.
+void TimerInit();
+void TimerDeinit();
+uint32_t TimerMicros();
 
 #ifdef __cplusplus
 }
@@ -39,6 +39,7 @@
 #endif
 #include "bootloader.h"
 #include "SelfProgram.h"
+#include "RamUsage.h"
 #include <stdio.h>
 
 #if defined(__AVR_ATtiny841__) || defined(__AVR_ATtiny441__)
@@ -95,8 +96,14 @@ void startApplication() {
 #endif
 
 extern void uart_init();
+extern void uart_setup();
+extern void uart_deinit();
 
 int main() {
+	#if defined(HAVE_RAM_USAGE)
+	RamUsage::paint();
+	#endif // defined(HAVE_RAM_USAGE)
+
 	#if defined(__AVR__)
 	// Disable watchdog, to prevent it triggering again
 	MCUSR &= ~(1 << WDRF);
@@ -117,6 +124,29 @@ int main() {
 	//uart_init();
 	//printf("Hello\n");
 
+	#if defined(ENABLE_TRACE)
+	uart_setup();
+	#endif // defined(ENABLE_TRACE)
+
+	#if defined(NEED_TIMER)
+	TimerInit();
+	#endif // defined(NEED_TIMER)
+
+	#if defined(FAST_BOOT)
+	if (fastBootAllowed()) {
+		#if defined(NEED_TIMER)
+		TimerDeinit();
+		#endif // defined(NEED_TIMER)
+		#if defined(ENABLE_TRACE)
+		uart_deinit();
+		#endif // defined(ENABLE_TRACE)
+		startApplication();
+	}
+	#endif // defined(FAST_BOOT)
+
 	runBootloader();
+	#if defined(ENABLE_TRACE)
+	uart_deinit();
+	#endif // defined(ENABLE_TRACE)
 	startApplication();
 }
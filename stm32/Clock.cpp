@@ -15,24 +15,199 @@
  */
 
 #include <libopencm3/stm32/rcc.h>
+#include <libopencm3/cm3/systick.h>
+#include <libopencm3/cm3/scb.h>
+#include <libopencm3/cm3/cortex.h>
 
+#include "../Config.h"
+#include "../BootProfile.h"
 #include "../bootloader.h"
 
-void ClockInit() {
+#if defined(CLOCK_BOOST)
+#include <libopencm3/stm32/flash.h>
+
+// PLL setup for 64Mhz from the 16Mhz HSE: VCO = 16Mhz / 1 * 8 =
+// 128Mhz, R output = 128Mhz / 2 = 64Mhz (P and Q are unused).
+static const uint32_t BOOST_PLLM = RCC_PLLCFGR_PLLM_DIV(1);
+static const uint32_t BOOST_PLLN = 8;
+static const uint32_t BOOST_PLLR = RCC_PLLCFGR_PLLR_DIV(2);
+static const uint32_t BOOST_FREQUENCY = 64000000;
+static const uint32_t HSI_FREQUENCY = 16000000;
+// Reset value of RCC_PLLCFGR
+static const uint32_t PLLCFGR_RESET = 0x00001000;
+
+#if defined(NEED_TIMER)
+static void TimerClockChanged();
+#endif // defined(NEED_TIMER)
+#if defined(ENABLE_TRACE)
+// The debug UART is set up by main() before the clock is changed
+extern void uart_clock_changed();
+#endif // defined(ENABLE_TRACE)
+#endif // defined(CLOCK_BOOST)
+
+bool ClockInit() {
+    uint32_t sws = (RCC_CFGR >> RCC_CFGR_SWS_SHIFT) & RCC_CFGR_SWS_MASK;
+
+    // When the application jumped into the bootloader directly, HSE
+    // might already be running, so skip the switch (and startup
+    // wait) then.
+    if (sws == RCC_CFGR_SW_HSE)
+        return false;
+
+    rcc_osc_on(RCC_HSE);
+    rcc_wait_for_osc_ready(RCC_HSE);
+    BOOT_PROFILE(OSC_READY);
+
+    #if defined(CLOCK_BOOST)
+    // The PLL cannot be reconfigured while in use (e.g. when the
+    // application left it running)
+    if (sws == RCC_CFGR_SW_PLLRCLK) {
+        rcc_set_sysclk_source(RCC_HSI);
+        rcc_wait_for_sysclk_status(RCC_HSI);
+    }
+    rcc_osc_off(RCC_PLL);
+    while (RCC_CR & RCC_CR_PLLRDY) /* wait */;
+
+    rcc_set_main_pll(RCC_PLLCFGR_PLLSRC_HSE, BOOST_PLLM, BOOST_PLLN,
+                     RCC_PLLCFGR_PLLP_DIV(2), RCC_PLLCFGR_PLLQ_DIV(2), BOOST_PLLR);
+    RCC_PLLCFGR |= RCC_PLLCFGR_PLLREN;
+    rcc_osc_on(RCC_PLL);
+    rcc_wait_for_osc_ready(RCC_PLL);
+
+    // Voltage scaling range 1 (the reset default) allows 64Mhz, but
+    // flash needs 2 wait states. AHB and APB prescalers are left at
+    // 1, so the bus peripherals also run at 64Mhz.
+    flash_set_ws(FLASH_ACR_LATENCY_2WS);
+    rcc_set_sysclk_source(RCC_PLL);
+    rcc_wait_for_sysclk_status(RCC_PLL);
+
+    // Used by libopencm3 to calculate baudrates
+    rcc_ahb_frequency = BOOST_FREQUENCY;
+    rcc_apb1_frequency = BOOST_FREQUENCY;
+    #if defined(NEED_TIMER)
+    TimerClockChanged();
+    #endif // defined(NEED_TIMER)
+    #if defined(ENABLE_TRACE)
+    uart_clock_changed();
+    #endif // defined(ENABLE_TRACE)
+    return true;
+    #else
     // This is essentially a simpler version of rcc_clock_setup() that
     // just switches to HSE. No need to do other setup (flash wait
     // states, voltage scaling) since HSE is also 16Mhz, so the defaults
     // should be fine (and the less we change, the less to revert).
-    rcc_osc_on(RCC_HSE);
-    rcc_wait_for_osc_ready(RCC_HSE);
-
+    uint32_t hsiDiv = (RCC_CR >> RCC_CR_HSIDIV_SHIFT) & RCC_CR_HSIDIV_MASK;
     rcc_set_sysclk_source(RCC_HSE);
     rcc_wait_for_sysclk_status(RCC_HSE);
+    // The clock only stays the same when coming from the undivided
+    // HSI (the reset state), not e.g. from a PLL left running by the
+    // application
+    return !(sws == RCC_CFGR_SW_HSISYS && hsiDiv == 0);
+    #endif // defined(CLOCK_BOOST)
 }
 
 void ClockDeinit() {
     rcc_set_sysclk_source(RCC_HSI);
     rcc_wait_for_sysclk_status(RCC_HSI);
 
+    #if defined(CLOCK_BOOST)
+    // Restore the reset state, slowing down flash only after
+    // slowing down the clock
+    rcc_osc_off(RCC_PLL);
+    while (RCC_CR & RCC_CR_PLLRDY) /* wait */;
+    RCC_PLLCFGR = PLLCFGR_RESET;
+    flash_set_ws(FLASH_ACR_LATENCY_0WS);
+
+    rcc_ahb_frequency = HSI_FREQUENCY;
+    rcc_apb1_frequency = HSI_FREQUENCY;
+    #if defined(ENABLE_TRACE)
+    uart_clock_changed();
+    #endif // defined(ENABLE_TRACE)
+    #endif // defined(CLOCK_BOOST)
+
     rcc_osc_off(RCC_HSE);
 }
+
+void ClockIdle(const volatile bool *done) {
+    cm_disable_interrupts();
+    if (!*done) {
+        // Use sleep mode (not deep sleep), which only stops the CPU
+        // clock, so peripherals keep running and wakeup takes just
+        // a few cycles. A pending interrupt ends the WFI even while
+        // interrupts are disabled, it is then handled below.
+        SCB_SCR &= ~SCB_SCR_SLEEPDEEP;
+        __asm__ volatile ("wfi");
+    }
+    cm_enable_interrupts();
+}
+
+#if defined(NEED_TIMER)
+// SysTick runs from HCLK / 8, which is 2Mhz for both HSI and HSE (8Mhz
+// with CLOCK_BOOST). It is only 24 bits, so count overflows in its
+// interrupt (every 8.4s, or 2.1s with CLOCK_BOOST).
+static volatile uint16_t timerOverflows;
+// Time at which the counter was last restarted
+static uint32_t timerOffset;
+// log2 of the number of ticks per μs
+static uint8_t timerShift = 1;
+
+extern "C" void sys_tick_handler() {
+    ++timerOverflows;
+}
+
+void TimerInit() {
+    timerOverflows = 0;
+    timerOffset = 0;
+    timerShift = 1;
+    systick_set_clocksource(STK_CSR_CLKSOURCE_AHB_DIV8);
+    systick_set_reload(STK_RVR_RELOAD);
+    systick_clear();
+    systick_interrupt_enable();
+    systick_counter_enable();
+}
+
+void TimerDeinit() {
+    systick_counter_disable();
+    systick_interrupt_disable();
+    STK_RVR = 0;
+    STK_CVR = 0;
+    // Do not leave an overflow pending for the application
+    SCB_ICSR = SCB_ICSR_PENDSTCLR;
+}
+
+uint32_t TimerMicros() {
+    uint16_t overflows;
+    uint32_t value;
+    // Retry when an overflow happens halfway
+    do {
+        overflows = timerOverflows;
+        value = systick_get_value();
+        // When called with interrupts masked or from an interrupt
+        // handler (with BUS_USE_INTERRUPTS), the overflow interrupt
+        // cannot run, so count a pending overflow here. Read the
+        // counter again, since it might have wrapped after reading.
+        if (SCB_ICSR & SCB_ICSR_PENDSTSET) {
+            value = systick_get_value();
+            ++overflows;
+        }
+    } while (overflows != timerOverflows);
+
+    uint64_t ticks = ((uint64_t)overflows << 24) | (STK_RVR_RELOAD - value);
+    return timerOffset + (uint32_t)(ticks >> timerShift);
+}
+
+#if defined(CLOCK_BOOST)
+// Restarts the counter at the current time, using the new tick rate
+// from now on (after switching to the PLL)
+static void TimerClockChanged() {
+    uint32_t now = TimerMicros();
+    systick_counter_disable();
+    systick_clear();
+    SCB_ICSR = SCB_ICSR_PENDSTCLR;
+    timerOverflows = 0;
+    timerOffset = now;
+    timerShift = 3;
+    systick_counter_enable();
+}
+#endif // defined(CLOCK_BOOST)
+#endif // defined(NEED_TIMER)
@@ -25,34 +25,74 @@ struct Pin {
 	void hiz() const;
 	void write(bool value) const;
 
+	// Configures the pin as an input and keeps its port clock
+	// enabled, so readInput() is just a register read. Undo with
+	// disable(), passing the value returned here.
+	bool enableInput() const;
+	bool readInput() const;
+	// Returns the pin to its reset state (analog). The port clock is
+	// left enabled only when it was already enabled before
+	// enableInput() and is still enabled now (i.e. when other code
+	// owns it).
+	void disable(bool clockWasEnabled) const;
+
 	enum rcc_periph_clken clock;
 	uint32_t port;
 	uint16_t pin_mask;
 };
 
+// Enables the given clock and returns whether it was already enabled,
+// to be passed to restoreClock(). This allows the other methods to
+// disable the clock again afterwards (to remove the need for a deinit
+// function), without breaking pins on the same port that were enabled
+// using enableInput().
+inline bool enableClock(enum rcc_periph_clken clock) {
+	bool enabled = _RCC_REG(clock) & _RCC_BIT(clock);
+	rcc_periph_clock_enable(clock);
+	return enabled;
+}
+
+inline void restoreClock(enum rcc_periph_clken clock, bool enabled) {
+	if (!enabled)
+		rcc_periph_clock_disable(clock);
+}
+
 inline bool Pin::read() const {
-	rcc_periph_clock_enable(this->clock);
+	bool enabled = enableClock(this->clock);
 	gpio_mode_setup(this->port, GPIO_MODE_INPUT, GPIO_PUPD_NONE, this->pin_mask);
 	bool val = gpio_get(this->port, this->pin_mask);
-	// Disable clock again, to remove need for deinit function
-	rcc_periph_clock_disable(this->clock);
+	restoreClock(this->clock, enabled);
 	return val;
 }
 
 inline void Pin::hiz() const {
-	rcc_periph_clock_enable(this->clock);
+	bool enabled = enableClock(this->clock);
 	gpio_mode_setup(this->port, GPIO_MODE_ANALOG, GPIO_PUPD_NONE, this->pin_mask);
-	// Disable clock again, to remove need for deinit function
-	rcc_periph_clock_disable(this->clock);
+	restoreClock(this->clock, enabled);
 }
 
 inline void Pin::write(bool value) const {
-	rcc_periph_clock_enable(this->clock);
+	bool enabled = enableClock(this->clock);
 	if (value)
 		gpio_set(this->port, this->pin_mask);
 	else
 		gpio_clear(this->port, this->pin_mask);
 	gpio_mode_setup(this->port, GPIO_MODE_OUTPUT, GPIO_PUPD_NONE, this->pin_mask);
-	// Disable clock again, to remove need for deinit function
-	rcc_periph_clock_disable(this->clock);
+	restoreClock(this->clock, enabled);
+}
+
+inline bool Pin::enableInput() const {
+	bool enabled = enableClock(this->clock);
+	gpio_mode_setup(this->port, GPIO_MODE_INPUT, GPIO_PUPD_NONE, this->pin_mask);
+	return enabled;
+}
+
+inline bool Pin::readInput() const {
+	return gpio_get(this->port, this->pin_mask);
+}
+
+inline void Pin::disable(bool clockWasEnabled) const {
+	bool enabled = enableClock(this->clock);
+	gpio_mode_setup(this->port, GPIO_MODE_ANALOG, GPIO_PUPD_NONE, this->pin_mask);
+	restoreClock(this->clock, enabled && clockWasEnabled);
 }
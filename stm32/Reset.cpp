@@ -20,6 +20,7 @@
 #include "stm32g0xx.h"
 #else
 #include <libopencm3/cm3/scb.h>
+#include <libopencm3/stm32/rcc.h>
 #endif
 
 #include "../BaseProtocol.h"
@@ -32,3 +33,15 @@ void resetSystem() {
 	#endif
 }
 
+#if defined(FAST_BOOT)
+bool resetWasColdBoot() {
+	// The flags are not cleared here, so they are still available
+	// to the application. This means that after a software reset,
+	// this keeps returning false until the application clears the
+	// flags or power is cycled, which errs on the side of staying
+	// in the bootloader. Note that the pin reset flag is also set
+	// on internally generated resets, so it cannot be used here.
+	return !(RCC_CSR & (RCC_CSR_SFTRSTF | RCC_CSR_IWDGRSTF | RCC_CSR_WWDGRSTF | RCC_CSR_LPWRRSTF));
+}
+#endif // defined(FAST_BOOT)
+
@@ -23,9 +23,15 @@
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/usart.h>
 #include <libopencm3/stm32/gpio.h>
+#include <libopencm3/cm3/nvic.h>
 #endif
 #include <stdio.h>
 #include "../Bus.h"
+#include "../Buffers.h"
+#include "../Trace.h"
+#if defined(HAVE_SLOTTED_QUERY)
+#include "../bootloader.h"
+#endif
 
 #if defined(USE_LL_HAL)
 	// Compatibility macros to run on ST LL HAL (e.g. inside STM32
@@ -66,36 +72,45 @@
 	#define rcc_periph_reset_pulse(instance) LL_APB2_GRP1_ForceReset(LL_APB2_GRP1_PERIPH_USART1)
 	#define usart1_isr USART1_IRQHandler
 	#define nvic_enable_irq NVIC_EnableIRQ
+	#define nvic_disable_irq NVIC_DisableIRQ
 	#define NVIC_USART1_IRQ USART1_IRQn
 #endif // defined(USE_LL_HAL)
 
 static uint8_t configuredAddress = 0;
 
-static const uint32_t BAUD_RATE = 1000000;
+static const uint32_t BAUD_RATE = RS485_BAUD_RATE;
 static const uint32_t MAX_INTER_FRAME = 150; // us
 static const uint32_t INTER_FRAME_BITS = (MAX_INTER_FRAME * BAUD_RATE + 1e6 - 1) / 1e6;
+// Start bit, 8 data bits, parity bit and stop bit
+static const uint32_t BITS_PER_BYTE = 11;
 
-void BusInit() {
+void BusInit(bool configured) {
 	BusResetDeviceAddress();
 
 	/* Setup clocks & GPIO for USART */
 	rcc_periph_clock_enable(RCC_USART1);
 	rcc_periph_clock_enable(RCC_GPIOA);
 
-	/* Setup USART parameters. */
-	usart_set_baudrate(USART1, BAUD_RATE);
-	usart_set_databits(USART1, 8+1); // Includes parity bit
-	usart_set_parity(USART1, USART_PARITY_EVEN);
-	usart_set_mode(USART1, USART_MODE_TX_RX);
+	if (!configured) {
+		// Start from the reset state, in case the application
+		// left the USART in some other state
+		rcc_periph_reset_pulse(RST_USART1);
+
+		/* Setup USART parameters. */
+		usart_set_baudrate(USART1, BAUD_RATE);
+		usart_set_databits(USART1, 8+1); // Includes parity bit
+		usart_set_parity(USART1, USART_PARITY_EVEN);
+		usart_set_mode(USART1, USART_MODE_TX_RX);
 
-	usart_set_rx_timeout_value(USART1, INTER_FRAME_BITS);
-	usart_enable_rx_timeout(USART1);
+		usart_set_rx_timeout_value(USART1, INTER_FRAME_BITS);
+		usart_enable_rx_timeout(USART1);
 
-	// Enable Driver Enable on RTS pin
-	USART_CR3(USART1) |= USART_CR3_DEM;
+		// Enable Driver Enable on RTS pin
+		USART_CR3(USART1) |= USART_CR3_DEM;
 
-	/* Finally enable the USART. */
-	usart_enable(USART1);
+		/* Finally enable the USART. */
+		usart_enable(USART1);
+	}
 
 	// RX & TX & RTS/DE
 	#if defined(USE_LL_HAL)
@@ -118,6 +133,10 @@ void BusInit() {
 }
 
 void BusDeinit() {
+	#if defined(BUS_USE_INTERRUPTS)
+	nvic_disable_irq(NVIC_USART1_IRQ);
+	#endif
+
 	rcc_periph_reset_pulse(RST_USART1);
 
 	#if defined(USE_LL_HAL)
@@ -146,10 +165,9 @@ void BusResetDeviceAddress() {
 }
 
 // For RS485, MAX_PACKET_LENGTH is defined including the address byte.
-// For requests, the address is stored outside of busBuffer, so this
+// For requests, the address is stored outside of buffers.bus, so this
 // buffer is 1 byte too long. However, for replies the adress is stored
 // inside the buffer, so use the full MAX_PACKET_LENGTH anyway.
-static uint8_t busBuffer[MAX_PACKET_LENGTH];
 static uint8_t busBufferLen = 0;
 static uint8_t busTxPos = 0;
 static uint8_t busAddress = 0;
@@ -158,10 +176,67 @@ static_assert(MAX_PACKET_LENGTH < (1 << (sizeof(busBufferLen) * 8)), "Code needs
 enum State {
 	StateIdle,
 	StateRead,
+	// Waiting for our slot before writing (see BusDelayReply())
+	StateDelay,
 	StateWrite
 };
 
 static State busState = StateIdle;
+static bool busOverflow = false;
+static uint32_t busDelayBytes = 0;
+
+#if defined(HAVE_SLOTTED_QUERY)
+// Set by BusDelayReply(), in byte times after the end of the request
+static bool busSlotted = false;
+static uint32_t busSlotStart;
+static uint8_t busSlotLength;
+// When the end of the current request was seen
+static uint32_t busFrameEnd;
+
+static_assert(BAUD_RATE % 1000 == 0, "Code needs changes for this baud rate");
+
+void BusDelayReply(uint8_t slot, uint8_t slotLength) {
+	// Each slot also includes an inter-frame gap, plus a byte of
+	// margin for differences in when each child saw the end of the
+	// request.
+	const uint32_t gap = (INTER_FRAME_BITS + BITS_PER_BYTE - 1) / BITS_PER_BYTE + 1;
+	busSlotted = true;
+	busSlotStart = slot * (slotLength + gap);
+	busSlotLength = slotLength;
+}
+
+// Converts the time spent on processing the request into the number
+// of filler bytes still needed to reach the slot. Returns false when
+// the reply can no longer be sent within the slot.
+static bool startSlot(uint8_t replyLen) {
+	// Limit to prevent overflow below, this is more than the
+	// biggest slot start anyway
+	const uint32_t maxElapsed = UINT32_MAX / (BAUD_RATE / 1000);
+	uint32_t elapsed = TimerMicros() - busFrameEnd;
+	if (elapsed > maxElapsed)
+		elapsed = maxElapsed;
+
+	// Round down, so the reply never starts before the slot
+	uint32_t elapsedBytes = elapsed * (BAUD_RATE / 1000) / (1000 * BITS_PER_BYTE);
+	if (elapsedBytes > busSlotStart + busSlotLength - replyLen)
+		return false;
+	busDelayBytes = elapsedBytes < busSlotStart ? busSlotStart - elapsedBytes : 0;
+	return true;
+}
+#endif // defined(HAVE_SLOTTED_QUERY)
+
+// While delaying a reply, filler bytes are sent to let the USART do the
+// timing. To prevent these from ending up on the bus, the DE pin is
+// taken away from the USART and kept low (inactive) in the meanwhile.
+static void setDriverEnabled(bool enabled) {
+	#if defined(USE_LL_HAL)
+	LL_GPIO_ResetOutputPin(GPIOA, LL_GPIO_PIN_12);
+	LL_GPIO_SetPinMode(GPIOA, LL_GPIO_PIN_12, enabled ? LL_GPIO_MODE_ALTERNATE : LL_GPIO_MODE_OUTPUT);
+	#else
+	gpio_clear(GPIOA, GPIO12);
+	gpio_mode_setup(GPIOA, enabled ? GPIO_MODE_AF : GPIO_MODE_OUTPUT, GPIO_PUPD_NONE, GPIO12);
+	#endif
+}
 
 static bool matchAddress(uint8_t address) {
 	if (address == 0) // General call
@@ -176,25 +251,41 @@ static bool matchAddress(uint8_t address) {
 }
 
 void BusUpdate() {
-	// Uncomment this to enable debug prints in this function
-	// Breaks Rs485 communication unless debug baudrate is 20x or so
-	// faster than Rs485!
-	#define printf(...) do {} while(0)
+	// Build with TRACE=1 to trace events in this function (see
+	// Trace.h)
 	uint32_t isr = USART_ISR(USART1);
 
 	/*
+	// Uncomment this to also trace all ISR changes (this easily
+	// fills the trace buffer)
 	static uint32_t prev_isr = 0;
 	if (isr != prev_isr) {
-		printf("isr: 0x%lx\n", isr);
+		TRACE(BUS_ISR, isr >> 8, isr);
 		prev_isr = isr;
 	}
 	*/
 
 
-	if (isr & USART_ISR_TXE && busState == StateWrite) {
+	if (busState == StateDelay) {
+		// Discard replies from other children
+		if (isr & USART_ISR_RXNE)
+			usart_recv(USART1);
+
+		if (busDelayBytes && isr & USART_ISR_TXE) {
+			usart_send(USART1, 0xff);
+			--busDelayBytes;
+		} else if (!busDelayBytes && isr & USART_ISR_TC) {
+			// Last filler byte is out, so it is our turn.
+			// Clear anything caused by the other replies.
+			USART_ICR(USART1) = USART_ICR_RTOCF | USART_ICR_PECF | USART_ICR_FECF | USART_ICR_ORECF;
+			setDriverEnabled(true);
+			busState = StateWrite;
+		}
+	} else if (isr & USART_ISR_TXE && busState == StateWrite) {
 		// TX register empty, writing data clears TXE
-		printf("tx: %02x\n", (unsigned)busBuffer[busTxPos]);
-		usart_send(USART1, busBuffer[busTxPos++]);
+		TRACE(BUS_TX, buffers.bus[busTxPos]);
+		usart_send(USART1, buffers.bus[busTxPos++]);
+		BUS_STATS_INC(bytesSent);
 		if (busTxPos >= busBufferLen)
 			busState = StateIdle;
 		// TODO: Clear error flags and/or RTOF after TX?
@@ -202,35 +293,44 @@ void BusUpdate() {
 
 		// Reading data clears RXNE
 		uint8_t data = usart_recv(USART1);
-		printf("rx: 0x%02x\n", (unsigned)data);
+		TRACE(BUS_RX, data);
+		BUS_STATS_INC(bytesReceived);
 
 		if (busState == StateIdle) {
 			busAddress = data;
 			busState = StateRead;
 			busBufferLen = 0;
-		} else if (busBufferLen < sizeof(busBuffer)) {
-			busBuffer[busBufferLen++] = data;
+			busOverflow = false;
+		} else if (busBufferLen < sizeof(buffers.bus)) {
+			buffers.bus[busBufferLen++] = data;
 		} else {
-			printf("rx ovf\n");
+			TRACE(BUS_RX_OVERFLOW, data);
+			busOverflow = true;
 		}
 	}
 	if ((isr & (USART_ISR_RTOF)) && busState == StateRead) {
 		// Sufficient silence after last RX byte
-		printf("rxtimeout after %u bytes\n", busBufferLen);
+		TRACE(BUS_FRAME_END, busBufferLen);
+		BUS_STATS_INC(framesSeen);
+		if (busOverflow)
+			BUS_STATS_INC(rxOverflows);
 
 		// This checks for errors that occurred during any byte
 		// in the transfer
 		bool rxok = true;
 		if (isr & USART_ISR_PE) {
-			printf("parity error during transfer\n");
+			TRACE(BUS_RX_ERROR, 0x01);
+			BUS_STATS_INC(parityErrors);
 			rxok = false;
 		}
 		if (isr & USART_ISR_FE ) {
-			printf("framing error during transfer\n");
+			TRACE(BUS_RX_ERROR, 0x02);
+			BUS_STATS_INC(framingErrors);
 			rxok = false;
 		}
 		if (isr & USART_ISR_ORE) {
-			printf("overrun error during transfer\n");
+			TRACE(BUS_RX_ERROR, 0x04);
+			BUS_STATS_INC(overrunErrors);
 			rxok = false;
 		}
 
@@ -238,15 +338,32 @@ void BusUpdate() {
 		USART_ICR(USART1) = USART_ICR_RTOCF | USART_ICR_PECF | USART_ICR_FECF | USART_ICR_ORECF;
 
 		bool matched = matchAddress(busAddress);
-		printf("address 0x%x %smatched\n", busAddress, matched ? "" : "not ");
+		TRACE(BUS_ADDRESS, busAddress, matched ? 0x01 : 0x00);
+		if (matched)
+			BUS_STATS_INC(framesAddressed);
 
 		// RX addressed to us, execute the callback and setup for a read.
 		if (!rxok || busBufferLen == 0 || !matched) {
 			busBufferLen = 0;
 		} else {
-			busBufferLen = BusCallback(busAddress, busBuffer, busBufferLen, sizeof(busBuffer));
+			busDelayBytes = 0;
+			#if defined(HAVE_SLOTTED_QUERY)
+			// Slots are timed from the end of the request,
+			// not from the end of processing it
+			busFrameEnd = TimerMicros();
+			busSlotted = false;
+			#endif // defined(HAVE_SLOTTED_QUERY)
+			busBufferLen = BusCallback(busAddress, buffers.bus, busBufferLen, sizeof(buffers.bus));
+			#if defined(HAVE_SLOTTED_QUERY)
+			if (busBufferLen && busSlotted && !startSlot(busBufferLen))
+				busBufferLen = 0;
+			#endif // defined(HAVE_SLOTTED_QUERY)
 		}
-		if (busBufferLen) {
+		if (busBufferLen && busDelayBytes) {
+			setDriverEnabled(false);
+			busState = StateDelay;
+			busTxPos = 0;
+		} else if (busBufferLen) {
 			busState = StateWrite;
 			busTxPos = 0;
 		} else {
@@ -255,12 +372,19 @@ void BusUpdate() {
 	}
 	if (busState == StateWrite) {
 		USART_CR1(USART1) |= USART_CR1_TXEIE;
-		USART_CR1(USART1) &= ~(USART_CR1_RXNEIE | USART_CR1_RTOIE);
+		USART_CR1(USART1) &= ~(USART_CR1_RXNEIE | USART_CR1_RTOIE | USART_CR1_TCIE);
+	} else if (busState == StateDelay && busDelayBytes) {
+		USART_CR1(USART1) |= USART_CR1_TXEIE | USART_CR1_RXNEIE;
+		USART_CR1(USART1) &= ~(USART_CR1_RTOIE | USART_CR1_TCIE);
+	} else if (busState == StateDelay) {
+		// TXE stays set now, so wait for the last filler byte
+		// to be completely sent instead
+		USART_CR1(USART1) |= USART_CR1_TCIE | USART_CR1_RXNEIE;
+		USART_CR1(USART1) &= ~(USART_CR1_RTOIE | USART_CR1_TXEIE);
 	} else {
-		USART_CR1(USART1) &= ~USART_CR1_TXEIE;
+		USART_CR1(USART1) &= ~(USART_CR1_TXEIE | USART_CR1_TCIE);
 		USART_CR1(USART1) |= USART_CR1_RXNEIE | USART_CR1_RTOIE;
 	}
-	#undef printf
 }
 
 #if defined(BUS_USE_INTERRUPTS)
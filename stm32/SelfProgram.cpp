@@ -17,6 +17,8 @@
  */
 
 #include <libopencm3/stm32/flash.h>
+#include <libopencm3/stm32/crc.h>
+#include <libopencm3/stm32/rcc.h>
 #include "../SelfProgram.h"
 
 // Writing happens per row
@@ -32,15 +34,25 @@
 #error "Incorrect FLASH_APP_OFFSET"
 #endif
 
+// Dual-bank parts (e.g. G0B1) number the pages in the second bank
+// differently, which flash_erase_page below does not account for.
+#if FLASH_APP_OFFSET + APPLICATION_SIZE > 0x20000
+#error "Dual-bank flash not supported"
+#endif
+
+#if FLASH_APP_OFFSET + APPLICATION_SIZE > 0x10000 && !defined(HAVE_EXTENDED_ADDRESSING)
+#error "Flash larger than 64k needs HAVE_EXTENDED_ADDRESSING"
+#endif
+
 uint8_t SelfProgram::eraseCount = 0;
 
-void SelfProgram::readFlash(uint16_t address, uint8_t *data, uint16_t len) {
+void SelfProgram::readFlash(flash_addr_t address, uint8_t *data, uint16_t len) {
 	for (uint8_t i=0; i < len; i++) {
 		data[i] = readByte(address + i);
 	}
 }
 
-uint8_t SelfProgram::readByte(uint16_t address) {
+uint8_t SelfProgram::readByte(flash_addr_t address) {
 	uint8_t *ptr = (uint8_t*)FLASH_BASE + address;
 	return *ptr;
 }
@@ -50,13 +62,24 @@ uint8_t SelfProgram::readByte(uint16_t address) {
 // happen. This also needs noinline to ensure this code is not inlined
 // into a function running from flash, and this function cannot call
 // other functions that run from flash, so it is a bit more hardcoded
-// that it could be.
+// that it could be. For the same reason, interrupts (e.g. the SysTick
+// overflow or the bus interrupt) are masked while programming, since
+// their vectors and handlers are in flash. Any interrupt that happens
+// is handled after PRIMASK is restored.
+// The first headLen bytes are taken from head, the rest from tail, so
+// a row can be programmed partly from the bus buffer directly.
 __attribute__(( __section__(".ramtext"), __noinline__ ))
-static void flash_program_row(uint16_t address, uint8_t *data, uint16_t len) {
+static void flash_program_row(flash_addr_t address, const uint8_t *head, uint16_t headLen, const uint8_t *tail, uint16_t len) {
 	#if !defined(STM32G0)
 	#warning "Fast programming code written for G0, might not work on other series"
 	#endif
 
+	// This uses inline assembly rather than the libopencm3
+	// functions, which might not be inlined
+	uint32_t primask;
+	__asm__ volatile ("mrs %0, primask" : "=r"(primask));
+	__asm__ volatile ("cpsid i" : : : "memory");
+
 	// Wait for previous operations (just in case)
 	while ((FLASH_SR & FLASH_SR_BSY) == FLASH_SR_BSY);
 
@@ -64,14 +87,13 @@ static void flash_program_row(uint16_t address, uint8_t *data, uint16_t len) {
 	FLASH_CR |= FLASH_CR_FSTPG;
 
 	for (uint16_t i = 0; i < 256; i += 4) {
-		auto make_word_le = [](uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
-			return (uint32_t)a << 0 | (uint32_t)b << 8 | (uint32_t)c << 16 | (uint32_t)d << 24;
-		};
-		uint32_t value = make_word_le(
-			i + 0 < len ? data[i + 0] : 0xff,
-			i + 1 < len ? data[i + 1] : 0xff,
-			i + 2 < len ? data[i + 2] : 0xff,
-			i + 3 < len ? data[i + 3] : 0xff);
+		// Assemble a little-endian word
+		uint32_t value = 0;
+		for (uint8_t j = 0; j < 4; ++j) {
+			uint16_t k = i + j;
+			uint8_t b = k < headLen ? head[k] : k < len ? tail[k - headLen] : 0xff;
+			value |= (uint32_t)b << (j * 8);
+		}
 
 		// Program each word in turn
 		MMIO32(FLASH_BASE + address + i) = value;
@@ -82,35 +104,15 @@ static void flash_program_row(uint16_t address, uint8_t *data, uint16_t len) {
 
 	// Disable fast programming again
 	FLASH_CR &= ~(FLASH_CR_FSTPG);
-}
-
-uint8_t SelfProgram::writePage(uint16_t address, uint8_t *data, uint16_t len) {
-	// Can only write to a row boundary
-	if (!len || address % FLASH_WRITE_SIZE != 0 || len > FLASH_WRITE_SIZE) {
-		return 1;
-	}
-
-	// If the address is past the application section don't write anything
-	if (address < FLASH_APP_OFFSET || address + len > FLASH_APP_OFFSET + applicationSize) {
-		return 3;
-	}
 
-	flash_unlock();
-	flash_clear_status_flags();
-
-	// If we are the beginning of a page, erase it
-	if (address % FLASH_ERASE_SIZE == 0) {
-		if (eraseCount < 0xff)
-			++eraseCount;
-		flash_erase_page(address / FLASH_ERASE_SIZE);
-	}
+	__asm__ volatile ("msr primask, %0" : : "r"(primask) : "memory");
+}
 
-	// If no errors from erase, then program
-	if (FLASH_SR == 0)
-		flash_program_row(address, data, len);
+// Locks the flash again and converts any error flags into a result
+// code.
+static uint8_t flash_finish() {
 	flash_lock();
 
-
 	// Get and clear error flags
 	uint32_t errbits = FLASH_SR & 0xffff;
 	FLASH_SR = 0xffff;
@@ -131,3 +133,139 @@ uint8_t SelfProgram::writePage(uint16_t address, uint8_t *data, uint16_t len) {
 	}
 	return res;
 }
+
+uint8_t SelfProgram::erasePage(flash_addr_t address, uint8_t * /* data */) {
+	// Can only erase at a page boundary
+	if (address % FLASH_ERASE_SIZE != 0) {
+		return 1;
+	}
+
+	// If the address is past the application section don't erase anything
+	if (address < FLASH_APP_OFFSET || address >= FLASH_APP_OFFSET + applicationSize) {
+		return 3;
+	}
+
+	flash_unlock();
+	flash_clear_status_flags();
+
+	if (eraseCount < 0xff)
+		++eraseCount;
+	flash_erase_page(address / FLASH_ERASE_SIZE);
+
+	return flash_finish();
+}
+
+uint8_t SelfProgram::writePage(flash_addr_t address, const uint8_t *head, uint16_t headLen, const uint8_t *tail, uint16_t len) {
+	// Can only write to a row boundary
+	if (!len || address % FLASH_WRITE_SIZE != 0 || len > FLASH_WRITE_SIZE) {
+		return 1;
+	}
+
+	// If the address is past the application section don't write anything
+	if (address < FLASH_APP_OFFSET || address + len > FLASH_APP_OFFSET + applicationSize) {
+		return 3;
+	}
+
+	flash_unlock();
+	flash_clear_status_flags();
+
+	flash_program_row(address, head, headLen, tail, len);
+
+	uint8_t res = flash_finish();
+
+	#if defined(VERIFY_FLASH)
+	// Read back what was written. Reason 4 is not a flash error
+	// bit count, so it cannot conflict with the above.
+	for (uint16_t i = 0; i < len && !res; ++i) {
+		uint8_t expected = i < headLen ? head[i] : tail[i - headLen];
+		if (readByte(address + i) != expected)
+			res = 4;
+	}
+	#endif // defined(VERIFY_FLASH)
+
+	return res;
+}
+
+#if defined(HAVE_IMAGE_MANIFEST)
+uint8_t SelfProgram::eraseMetadata() {
+	flash_unlock();
+	flash_clear_status_flags();
+
+	flash_erase_page(metadataAddress / FLASH_ERASE_SIZE);
+
+	return flash_finish();
+}
+
+uint8_t SelfProgram::writeMetadata(uint16_t offset, const uint8_t *data, uint16_t len) {
+	if (offset % 8 != 0 || len % 8 != 0 || offset + len > FLASH_ERASE_SIZE)
+		return 1;
+
+	flash_unlock();
+	flash_clear_status_flags();
+
+	while (len && FLASH_SR == 0) {
+		len -= 8;
+		uint64_t value = 0;
+		for (uint8_t i = 0; i < 8; ++i)
+			value |= (uint64_t)data[len + i] << (i * 8);
+		flash_program_double_word(FLASH_BASE + metadataAddress + offset + len, value);
+	}
+
+	return flash_finish();
+}
+#endif // defined(HAVE_IMAGE_MANIFEST)
+
+#if defined(VERIFY_FLASH)
+uint32_t SelfProgram::crc32Update(uint32_t crc, flash_addr_t address, flash_addr_t len) {
+	// Use the hardware CRC unit, a software CRC over the entire
+	// flash would take too long to reply in time. The default
+	// polynomial is used, but with reflected input to get the
+	// zlib/ethernet variant. The output is not reflected here, so
+	// the raw register value can be loaded again as the initial
+	// value to continue the calculation later.
+	rcc_periph_clock_enable(RCC_CRC);
+	crc_set_reverse_input(CRC_CR_REV_IN_BYTE);
+	crc_reverse_output_disable();
+	crc_set_initial(crc);
+	crc_reset();
+
+	// Write per byte up to a word boundary, then per word (which is
+	// about four times faster). Reversing the bits of an entire
+	// word processes the little-endian bytes in the same order as
+	// writing them per byte.
+	const uint8_t *ptr = (const uint8_t*)FLASH_BASE + address;
+	while (len && ((uintptr_t)ptr & 3)) {
+		MMIO8(CRC_BASE) = *ptr++;
+		--len;
+	}
+	if (len >= 4) {
+		crc_set_reverse_input(CRC_CR_REV_IN_WORD);
+		while (len >= 4) {
+			MMIO32(CRC_BASE) = *(const uint32_t*)ptr;
+			ptr += 4;
+			len -= 4;
+		}
+		// Reading the result waits for the calculation to
+		// complete, before changing the mode again
+		(void)CRC_DR;
+		crc_set_reverse_input(CRC_CR_REV_IN_BYTE);
+	}
+	while (len--)
+		MMIO8(CRC_BASE) = *ptr++;
+
+	crc = CRC_DR;
+	rcc_periph_clock_disable(RCC_CRC);
+	return crc;
+}
+
+uint32_t SelfProgram::crc32Finish(uint32_t crc) {
+	// Reflect and invert the output. Cortex-M0+ has no RBIT
+	// instruction, so do this bit by bit.
+	uint32_t result = 0;
+	for (uint8_t i = 0; i < 32; ++i) {
+		result = result << 1 | (crc & 1);
+		crc >>= 1;
+	}
+	return ~result;
+}
+#endif // defined(VERIFY_FLASH)
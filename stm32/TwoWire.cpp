@@ -20,12 +20,14 @@
 #include <libopencm3/stm32/gpio.h>
 #include <stdio.h>
 #include "../Bus.h"
+#include "../Buffers.h"
+#include "../Trace.h"
 
 #if defined(BUS_USE_INTERRUPTS)
 #error "Interrupts not supported"
 #endif
 
-void BusInit() {
+void BusInit(bool /* configured */) {
 	rcc_periph_clock_enable(RCC_GPIOB);
 	rcc_periph_clock_enable(RCC_I2C1);
 
@@ -39,8 +41,8 @@ void BusInit() {
 	i2c_enable_analog_filter(I2C1);
 	i2c_set_digital_filter(I2C1, 0);
 
-	/* HSI is at 16Mhz */
-	i2c_set_speed(I2C1, i2c_speed_sm_100k, 16);
+	// Uses the frequency set up by ClockInit()
+	i2c_set_speed(I2C1, i2c_speed_sm_100k, rcc_apb1_frequency / 1000000);
 	i2c_enable_stretching(I2C1);
 
 	BusResetDeviceAddress();
@@ -80,11 +82,14 @@ void BusResetDeviceAddress() {
 	I2C_OAR2(I2C1) = I2C_OAR2_OA2EN | (oa2msk << 8) | (INITIAL_ADDRESS << 1);
 }
 
-static uint8_t twiBuffer[MAX_PACKET_LENGTH];
 static uint8_t twiBufferLen = 0;
 static uint8_t twiReadPos = 0;
 static uint8_t twiAddress = 0;
 static bool isReadOperation;
+#if defined(HAVE_STREAMING)
+// Set when the current transaction is part of a stream
+static bool twiStreaming = false;
+#endif
 static_assert(MAX_PACKET_LENGTH < (1 << (sizeof(twiBufferLen) * 8)), "Code needs changes for bigger packets");
 
 // Extract the address from the I²C status register
@@ -102,39 +107,61 @@ enum TWIState {
 static TWIState twiState = TWIStateIdle;
 
 void BusUpdate() {
-	// Uncomment this to enable debug prints in this function
-	#define printf(...) do {} while(0)
+	// Build with TRACE=1 to trace events in this function (see
+	// Trace.h)
 	uint32_t isr = I2C_ISR(I2C1);
 	if (isr & (I2C_ISR_RXNE|I2C_ISR_TXIS|I2C_ISR_STOPF|I2C_ISR_ADDR))
-		printf("isr: 0x%lx, %lx\n", isr, I2C_CR2(I2C1));
+		TRACE(BUS_ISR, isr >> 8, isr);
 
 	if (isr & I2C_ISR_RXNE) { // Received data
 		// Reading data clears RXNE
 		uint8_t data = i2c_get_data(I2C1);
 
-		if (twiBufferLen < sizeof(twiBuffer))
-			twiBuffer[twiBufferLen++] = data;
-		printf("rx: 0x%02x\n", (unsigned)data);
+		#if defined(HAVE_STREAMING)
+		// Pass on a full buffer. The clock is stretched after
+		// the next byte until this is done.
+		if (twiStreaming && twiBufferLen == sizeof(buffers.bus)) {
+			BusStreamWrite(buffers.bus, twiBufferLen);
+			twiBufferLen = 0;
+		}
+		#endif
+		if (twiBufferLen < sizeof(buffers.bus))
+			buffers.bus[twiBufferLen++] = data;
+		TRACE(BUS_RX, data);
 	}
 	if (isr & I2C_ISR_TXIS) {
 		// TX byte needed
 		// writing data clears TXIS
 		//i2c_send_data(I2C1, *write_p--);
+		#if defined(HAVE_STREAMING)
+		if (twiStreaming && twiReadPos == twiBufferLen) {
+			twiBufferLen = BusStreamRead(buffers.bus, sizeof(buffers.bus));
+			twiReadPos = 0;
+		}
+		#endif
 		if (twiReadPos < twiBufferLen) {
-			printf("tx: %02x\n", (unsigned)twiBuffer[twiReadPos]);
-			i2c_send_data(I2C1, twiBuffer[twiReadPos++]);
+			TRACE(BUS_TX, buffers.bus[twiReadPos]);
+			i2c_send_data(I2C1, buffers.bus[twiReadPos++]);
 		} else {
-			printf("tx ovf\n");
+			TRACE(BUS_TX_UNDERFLOW);
 			// Send dummy data
 			i2c_send_data(I2C1, 0);
 		}
 	}
 	// This runs on STOPF but also on ADDR to handle repeated start
+	#if defined(HAVE_STREAMING)
+	if ((isr & (I2C_ISR_STOPF|I2C_ISR_ADDR)) && twiStreaming) {
+		TRACE(BUS_STOP);
+		twiBufferLen = BusStreamEnd(buffers.bus, twiBufferLen, sizeof(buffers.bus));
+		twiStreaming = false;
+		twiState = TWIStateIdle;
+	} else
+	#endif
 	if ((isr & (I2C_ISR_STOPF|I2C_ISR_ADDR)) && twiState == TWIStateWrite) {
-		printf("stop|repstart\n");
+		TRACE(BUS_STOP);
 		// If we were previously in a write, then execute the callback and setup for a read.
 		if (twiBufferLen != 0)
-			twiBufferLen = BusCallback(twiAddress, twiBuffer, twiBufferLen, sizeof(twiBuffer));
+			twiBufferLen = BusCallback(twiAddress, buffers.bus, twiBufferLen, sizeof(buffers.bus));
 		twiState = TWIStateIdle;
 	}
 	// Clear stop flag
@@ -147,6 +174,9 @@ void BusUpdate() {
 		// have already changed (if the stop is directly
 		// followed by a new transaction).
 		isReadOperation = (isr & I2C_ISR_DIR_READ);
+		#if defined(HAVE_STREAMING)
+		twiStreaming = BusStreamBegin(address_from_isr(isr), isReadOperation);
+		#endif
 
 		// Send an ack unless a read is starting and there are no bytes to read.
 		bool ack = (twiBufferLen > 0) || (!isReadOperation);
@@ -170,7 +200,7 @@ void BusUpdate() {
 
 		// The address is in the high 7 bits, the RD/WR bit is in the lsb
 		twiAddress = address_from_isr(isr);
-		printf("addr: 0x%02x (%c, %s)\n", (unsigned)twiAddress, isReadOperation ? 'r' : 'w', ack ? "ack" : "nak");
+		TRACE(BUS_ADDRESS, twiAddress, (ack ? 0x01 : 0x00) | (isReadOperation ? 0x02 : 0x00));
 
 		// Force TXE to flush any TX data still leftover from a
 		// previous transaction
@@ -180,5 +210,4 @@ void BusUpdate() {
 		I2C_ICR(I2C1) = I2C_ICR_ADDRCF;
 		twiState = isReadOperation ? TWIStateRead : TWIStateWrite;
 	}
-	#undef printf
 }
@@ -38,7 +38,9 @@ static cookie_io_functions_t functions = {
 	.close = NULL
 };
 
-void uart_init(void) {
+// Sets up the UART hardware only, for use with uart_try_write() (this
+// does not pull in stdio like uart_init() does).
+void uart_setup(void) {
 	/* Setup clocks & GPIO for USART */
 	rcc_periph_clock_enable(RCC_USART2);
 	rcc_periph_clock_enable(RCC_GPIOA);
@@ -55,9 +57,45 @@ void uart_init(void) {
 
 	/* Finally enable the USART. */
 	usart_enable(USART2);
+}
+
+// Recalculates the baudrate after the clock frequency changed. The
+// USART must be disabled for that, so let any byte in progress finish
+// first.
+void uart_clock_changed(void) {
+	while (!(USART_ISR(USART2) & USART_ISR_TC)) /* wait */;
+	usart_disable(USART2);
+	usart_set_baudrate(USART2, BAUD);
+	usart_enable(USART2);
+}
+
+// Returns the USART and its pin to their reset state, after the byte in
+// progress has been sent, before starting the application.
+void uart_deinit(void) {
+	while (!(USART_ISR(USART2) & USART_ISR_TC)) /* wait */;
+	rcc_periph_reset_pulse(RST_USART2);
+	rcc_periph_clock_disable(RCC_USART2);
+
+	// The bus code might have disabled this clock already
+	rcc_periph_clock_enable(RCC_GPIOA);
+	gpio_mode_setup(GPIOA, GPIO_MODE_ANALOG, GPIO_PUPD_NONE, GPIO2);
+	gpio_set_af(GPIOA, GPIO_AF0, GPIO2);
+	rcc_periph_clock_disable(RCC_GPIOA);
+}
+
+void uart_init(void) {
+	uart_setup();
 
 	/* Setup stdout for printf. This is a GNU-specific extension to libc. */
 	stdout = fopencookie(NULL, "w", functions);
 	/* Disable buffering, so the callbacks get called right away */
 	setbuf(stdout, nullptr);
 }
+
+// Writes a byte if the UART is ready to accept it, without blocking
+bool uart_try_write(uint8_t byte) {
+	if (!(USART_ISR(USART2) & USART_ISR_TXE))
+		return false;
+	usart_send(USART2, byte);
+	return true;
+}
@@ -0,0 +1,86 @@
+#!/usr/bin/env python3
+#
+# Decodes trace records sent by the bootloader when built with TRACE=1
+# (see Trace.h). Reads raw bytes from a serial port or a file (e.g.
+# captured earlier) and prints one line per record.
+#
+# Copyright 2025 3devo (http://www.3devo.eu)
+#
+# Permission is hereby granted, free of charge, to anyone obtaining a
+# copy of this document to do whatever they want with them without any
+# restriction, including, but not limited to, copying, modification and
+# redistribution.
+#
+# NO WARRANTY OF ANY KIND IS PROVIDED.
+
+import argparse
+import struct
+import sys
+
+SYNC = 0xa5
+RECORD_LEN = 8
+
+# Keep in sync with Trace::Events in Trace.h
+RX_ERRORS = {0x01: "parity", 0x02: "framing", 0x04: "overrun"}
+
+EVENTS = {
+    0x00: ("dropped", lambda a, b: "{} records".format(a << 8 | b)),
+    0x01: ("isr", lambda a, b: "0x....{:04x}".format(a << 8 | b)),
+    0x02: ("rx", lambda a, b: "0x{:02x}".format(a)),
+    0x03: ("tx", lambda a, b: "0x{:02x}".format(a)),
+    0x04: ("rx overflow", lambda a, b: "0x{:02x} dropped".format(a)),
+    0x05: ("tx underflow", None),
+    0x06: ("frame end", lambda a, b: "{} bytes".format(a)),
+    0x07: ("rx error", lambda a, b: RX_ERRORS.get(a, "0x{:02x}".format(a))),
+    0x08: ("address", lambda a, b: "0x{:02x} ({}, {})".format(
+        a, "r" if b & 0x02 else "w", "ack" if b & 0x01 else "nak")),
+    0x09: ("stop", None),
+}
+
+
+def records(stream):
+    """Yields (event, time, a, b) tuples, resynchronizing on garbage."""
+    buf = b""
+    while True:
+        data = stream.read(64)
+        if not data:
+            return
+        buf += data
+        while len(buf) >= RECORD_LEN:
+            if buf[0] != SYNC:
+                buf = buf[1:]
+                continue
+            event, time, a, b = struct.unpack(">BLBB", buf[1:RECORD_LEN])
+            if event not in EVENTS:
+                # Probably a data byte that looked like a sync byte
+                buf = buf[1:]
+                continue
+            buf = buf[RECORD_LEN:]
+            yield event, time, a, b
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("input", help="Serial port or file to read from, - for stdin")
+    parser.add_argument("--baud", type=int, default=1000000, help="Baudrate when reading from a serial port (default: %(default)s)")
+    args = parser.parse_args()
+
+    if args.input == "-":
+        stream = sys.stdin.buffer
+    elif args.input.startswith("/dev/") or args.input.upper().startswith("COM"):
+        import serial
+        stream = serial.Serial(args.input, args.baud)
+    else:
+        stream = open(args.input, "rb")
+
+    prev = None
+    for event, time, a, b in records(stream):
+        name, fmt = EVENTS[event]
+        delta = "" if prev is None else "+{}".format((time - prev) & 0xffffffff)
+        prev = time
+        details = fmt(a, b) if fmt else ""
+        print("{:>10}us {:>9} {:<13} {}".format(time, delta, name, details).rstrip())
+
+
+if __name__ == "__main__":
+    main()